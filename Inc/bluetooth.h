@@ -8,6 +8,22 @@
 
 #define BLUETOOTH_RECEIVED_DATA_BUFFER 20
 #define BLUETOOTH_ADDRESS_LENGTH 17
+#define BLUETOOTH_LINE_BUFFER_SIZE 128
+#define BLUETOOTH_MAX_INSTANCES 2
+#define BLUETOOTH_EVENT_QUEUE_SIZE 16
+#define BLUETOOTH_TX_QUEUE_SIZE 8
+#define BLUETOOTH_TX_CHUNK_SIZE 32
+#define BLUETOOTH_NAME_LENGTH 32
+#define BLUETOOTH_RX_STREAM_CHUNK_SIZE 32
+#define BLUETOOTH_CONFIG_SNAPSHOT_VERSION 1
+
+/* Set to 0 when the application keeps its own HAL_UART_xxxCallback definitions,
+ * it must then forward them to bluetooth_onRxComplete, bluetooth_onTxComplete,
+ * bluetooth_onRxIdle and bluetooth_onError
+ * */
+#ifndef BLUETOOTH_OWN_HAL_CALLBACKS
+#define BLUETOOTH_OWN_HAL_CALLBACKS 1
+#endif
 
 enum Bluetooth_response
 {
@@ -37,6 +53,24 @@ enum Bluetooth_moduleRole
 	BLUETOOTH_UNKNOWN_ROLE
 };
 
+enum Bluetooth_eventType
+{
+	BLUETOOTH_EVENT_DATA_RECEIVED,
+	BLUETOOTH_EVENT_TX_DONE,
+	BLUETOOTH_EVENT_COMMAND_COMPLETE,
+	BLUETOOTH_EVENT_LINK_UP,
+	BLUETOOTH_EVENT_LINK_DOWN,
+	BLUETOOTH_EVENT_ERROR,
+	BLUETOOTH_EVENT_COUNT
+};
+
+enum Bluetooth_txPriority
+{
+	BLUETOOTH_TX_PRIORITY_HIGH,
+	BLUETOOTH_TX_PRIORITY_BULK,
+	BLUETOOTH_TX_PRIORITY_COUNT
+};
+
 typedef struct
 {
 	uint32_t baudRate: 28;
@@ -51,19 +85,98 @@ typedef struct
 	bool isDataReady;
 }bluetooth_receivedDataBuffer;
 
+typedef struct
+{
+	bluetooth_SerialParameters serialParameters;
+	enum Bluetooth_moduleRole role;
+	char name[BLUETOOTH_NAME_LENGTH + 1];
+}bluetooth_moduleConfig;
+
+/* Non-volatile storage for the configuration snapshot: backup SRAM, a flash page, a file on the host...
+ * Both functions return false when the whole block could not be transferred
+ * */
+typedef struct
+{
+	bool (*read)(void *context, void *data, uint32_t size);
+	bool (*write)(void *context, const void *data, uint32_t size);
+	void *context;
+}bluetooth_configStore;
+
+typedef struct
+{
+	uint32_t overrunErrors;
+	uint32_t framingErrors;
+	uint32_t noiseErrors;
+	uint32_t parityErrors;
+	uint32_t dmaErrors;
+	uint32_t recoveries; // receptions re-armed in place after HAL stopped them
+	uint32_t failedRecoveries;
+	uint32_t lostBytes; // lower bound: discarded partial data, RX stream ring overflows and one byte per overrun
+	uint32_t maxRecoveryCycles;
+}bluetooth_uartErrorStats;
+
+typedef struct
+{
+	bool warmStart; // snapshot was trusted, no rediscovery was needed
+	uint32_t startupTimeMs;
+}bluetooth_startupReport;
+
 typedef enum Bluetooth_response Bluetooth_response;
 typedef enum Bluetooth_stopBit Bluetooth_stopBit;
 typedef enum Bluetooth_parity Bluetooth_parity;
 typedef enum Bluetooth_moduleRole Bluetooth_moduleRole;
+typedef enum Bluetooth_eventType Bluetooth_eventType;
+typedef enum Bluetooth_txPriority Bluetooth_txPriority;
 
 typedef struct bluetooth_handler_t bluetooth_handler_t;
 
+typedef struct
+{
+	Bluetooth_eventType type;
+	const uint8_t *data; // receive buffer of the instance for received data, the queued buffer for its TX_DONE, NULL otherwise
+	uint16_t length; // bytes in the receive buffer for DATA_RECEIVED and COMMAND_COMPLETE, message length of a queued TX_DONE
+	uint32_t errorCode; // HAL_UART_ERROR_xxx flags for ERROR
+}bluetooth_event;
+
+typedef void (*bluetooth_eventHandler)(bluetooth_handler_t *bluetooth, const bluetooth_event *event, void *context);
+
+typedef struct
+{
+	uint32_t queuedEvents;
+	uint32_t droppedEvents;
+	uint16_t maxQueueDepth;
+	uint32_t maxIsrCycles;
+}bluetooth_eventStats;
+
+typedef struct
+{
+	uint32_t queuedMessages;
+	uint32_t sentMessages;
+	uint32_t rejectedMessages;
+	uint16_t queueDepth;
+	uint16_t maxQueueDepth;
+	uint32_t maxLatencyUs; // from bluetooth_queueMessage until the last byte left the UART
+}bluetooth_txStats;
+
+// receive buffer of the first instance only, the others report their data through event.data
 extern bluetooth_receivedDataBuffer bluetooth_interruptBuffer;
 
+#ifdef BKPSRAM_BASE
+/* Keeps the snapshot across power cycles only with a battery on VBAT,
+ * writing turns the backup regulator on and fails when it does not become ready
+ * */
+extern const bluetooth_configStore bluetooth_backupSramStore;
+#endif
+
 bluetooth_handler_t* bluetooth_init(UART_HandleTypeDef *uart_handler);
 void bluetooth_destroy(bluetooth_handler_t* bluetooth);
 
+void bluetooth_enableCycleCounter(void);
+uint32_t bluetooth_cyclesToMicroseconds(uint32_t cycles);
+
 Bluetooth_response bluetooth_pingDevice(bluetooth_handler_t *bluetooth);
+Bluetooth_response bluetooth_startup(bluetooth_handler_t *bluetooth, const bluetooth_configStore *store, bluetooth_moduleConfig *config, bluetooth_startupReport *report);
+Bluetooth_response bluetooth_saveConfig(const bluetooth_configStore *store, const bluetooth_moduleConfig *config);
 Bluetooth_response bluetooth_setUartBaudrate(bluetooth_handler_t* bluetooth, uint32_t newBaudrate);
 
 Bluetooth_response bluetooth_setSerialParameters(bluetooth_handler_t *bluetooth, bluetooth_SerialParameters serialParam);
@@ -75,10 +188,32 @@ Bluetooth_response bluetooth_reset(bluetooth_handler_t *bluetooth);
 Bluetooth_response bluetooth_sendMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t timeout);
 Bluetooth_response bluetooth_sendMessage_IT(bluetooth_handler_t *bluetooth, char* message);
 Bluetooth_response bluetooth_sendMessage_DMA(bluetooth_handler_t *bluetooth, char* message);
+Bluetooth_response bluetooth_queueMessage(bluetooth_handler_t *bluetooth, const uint8_t* data, uint16_t length, Bluetooth_txPriority priority);
+void bluetooth_getTxStats(bluetooth_handler_t *bluetooth, Bluetooth_txPriority priority, bluetooth_txStats *stats);
+Bluetooth_response bluetooth_sendData(bluetooth_handler_t *bluetooth, const uint8_t* data, uint16_t length, uint32_t timeout);
 
 Bluetooth_response bluetooth_readMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, uint32_t timeout);
+Bluetooth_response bluetooth_readData(bluetooth_handler_t *bluetooth, uint8_t* data, uint16_t length, uint32_t timeout);
+Bluetooth_response bluetooth_exchangeData(bluetooth_handler_t *bluetooth, const uint8_t* txData, uint8_t* rxData, uint16_t length, uint32_t timeout);
+Bluetooth_response bluetooth_readUntil(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, const char* delimiter, uint32_t timeout);
+Bluetooth_response bluetooth_readLine(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, uint32_t timeout);
 Bluetooth_response bluetooth_readMessage_IT(bluetooth_handler_t *bluetooth, uint32_t messageLength);
 Bluetooth_response bluetooth_readMessage_DMA(bluetooth_handler_t *bluetooth, uint32_t messageLength);
+Bluetooth_response bluetooth_readMessage_ToIdle(bluetooth_handler_t *bluetooth, uint32_t maxMessageLength);
+Bluetooth_response bluetooth_startRxStream(bluetooth_handler_t *bluetooth, uint8_t *ring, uint16_t ringSize);
+Bluetooth_response bluetooth_stopRxStream(bluetooth_handler_t *bluetooth);
+uint16_t bluetooth_readRxStream(bluetooth_handler_t *bluetooth, uint8_t *data, uint16_t maxLength);
+
+Bluetooth_response bluetooth_registerEventHandler(bluetooth_handler_t *bluetooth, Bluetooth_eventType type, bluetooth_eventHandler handler, void *context);
+uint32_t bluetooth_processEvents(bluetooth_handler_t *bluetooth);
+void bluetooth_notifyLinkState(bluetooth_handler_t *bluetooth, bool connected);
+void bluetooth_getEventStats(bluetooth_handler_t *bluetooth, bluetooth_eventStats *stats);
+void bluetooth_getUartErrorStats(bluetooth_handler_t *bluetooth, bluetooth_uartErrorStats *stats);
+
+void bluetooth_onRxComplete(UART_HandleTypeDef *huart);
+void bluetooth_onTxComplete(UART_HandleTypeDef *huart);
+void bluetooth_onRxIdle(UART_HandleTypeDef *huart, uint16_t size);
+void bluetooth_onError(UART_HandleTypeDef *huart);
 
 Bluetooth_response bluetooth_getName(bluetooth_handler_t *bluetooth, char* name);
 Bluetooth_response bluetooth_setName(bluetooth_handler_t *bluetooth, char* name);
@@ -88,5 +223,6 @@ Bluetooth_response bluetooth_setPassword(bluetooth_handler_t *bluetooth, char* p
 
 Bluetooth_response bluetooth_getModuleAddress(bluetooth_handler_t *bluetooth, char moduleAddress[BLUETOOTH_ADDRESS_LENGTH + 1]);
 Bluetooth_response bluetooth_getModuleRole(bluetooth_handler_t *bluetooth, Bluetooth_moduleRole* moduleRole);
+Bluetooth_response bluetooth_setModuleRole(bluetooth_handler_t *bluetooth, Bluetooth_moduleRole moduleRole);
 
 #endif
@@ -0,0 +1,639 @@
+#ifndef _BLUETOOTH_HPP__
+#define _BLUETOOTH_HPP__
+
+/* Header-only C++20 layer over the module AT protocol.
+ * Storage is a member of the class template, so nothing is allocated at runtime,
+ * commands are encoded at compile time and the transport is a policy type.
+ * */
+
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+// the HAL header pulls in stm32f4xx_hal_conf.h, which is what defines HAL_UART_MODULE_ENABLED
+#if __has_include("stm32f4xx_hal.h")
+#include "stm32f4xx_hal.h"
+#endif
+
+namespace bluetooth
+{
+
+enum class Response
+{
+	Ok,
+	Fail
+};
+
+enum class StopBit : uint8_t
+{
+	One = 0,
+	Two = 1
+};
+
+enum class Parity : uint8_t
+{
+	None = 0,
+	Odd = 1,
+	Even = 2
+};
+
+enum class Role : uint8_t
+{
+	Slave = 0,
+	Master = 1,
+	SlaveLoop = 2
+};
+
+struct SerialParameters
+{
+	uint32_t baudRate;
+	StopBit stopBit;
+	Parity parity;
+};
+
+// "ab:cd:12:34:ef:56", the same form as the C driver reports
+using Address = std::array<char, 17>;
+
+/* A transport has to send a whole span or fail,
+ * and report how many bytes it managed to receive before the timeout
+ * */
+template<typename T>
+concept UartPolicy = requires(T& uart, std::span<const std::byte> txData, std::span<std::byte> rxData, uint32_t timeout)
+{
+	{ uart.transmit(txData, timeout) } -> std::same_as<bool>;
+	{ uart.receive(rxData, timeout) } -> std::same_as<std::size_t>;
+};
+
+#ifdef HAL_UART_MODULE_ENABLED
+class HalUart
+{
+public:
+	explicit HalUart(UART_HandleTypeDef& uartHandler) : huart(uartHandler) {}
+
+	bool transmit(std::span<const std::byte> data, uint32_t timeout)
+	{
+		return HAL_UART_Transmit(&huart, reinterpret_cast<const uint8_t*>(data.data()), data.size(), timeout) == HAL_OK;
+	}
+
+	std::size_t receive(std::span<std::byte> data, uint32_t timeout)
+	{
+		const HAL_StatusTypeDef status = HAL_UART_Receive(&huart, reinterpret_cast<uint8_t*>(data.data()), data.size(), timeout);
+		if(status == HAL_OK)
+		{
+			return data.size();
+		}
+
+		/* Only after a timeout does RxXferCount belong to this transfer (bytes still missing),
+		 * on HAL_BUSY or HAL_ERROR it describes some other reception
+		 * */
+		if(status != HAL_TIMEOUT || huart.RxXferCount > data.size())
+		{
+			return 0;
+		}
+
+		return data.size() - huart.RxXferCount;
+	}
+
+private:
+	UART_HandleTypeDef& huart;
+};
+#endif
+
+/** AT command encoding ------------------------------------------------------*/
+template<std::size_t Capacity>
+class Command
+{
+public:
+	constexpr Command& append(std::string_view text)
+	{
+		for(char ch : text)
+		{
+			characters[length++] = ch;
+		}
+		return *this;
+	}
+
+	constexpr Command& append(uint32_t number)
+	{
+		char digits[10] = {};
+		std::size_t count = 0;
+		do
+		{
+			digits[count++] = static_cast<char>('0' + number % 10);
+			number /= 10;
+		} while(number != 0);
+
+		while(count > 0)
+		{
+			characters[length++] = digits[--count];
+		}
+		return *this;
+	}
+
+	constexpr std::string_view view() const
+	{
+		return std::string_view(characters.data(), length);
+	}
+
+	std::span<const std::byte> bytes() const
+	{
+		return std::as_bytes(std::span<const char>(characters.data(), length));
+	}
+
+private:
+	std::array<char, Capacity> characters{};
+	std::size_t length = 0;
+};
+
+namespace at
+{
+
+inline constexpr std::string_view okResponse = "OK\r\n";
+inline constexpr std::string_view errorResponse = "ERROR";
+inline constexpr std::size_t maxNameLength = 32;
+inline constexpr std::size_t pinLength = 4;
+
+// "AT" + body + "\r\n", sized exactly for the literal
+template<std::size_t N>
+consteval Command<N + 3> make(const char (&body)[N])
+{
+	Command<N + 3> command;
+	command.append("AT").append(std::string_view(body, N - 1)).append("\r\n");
+	return command;
+}
+
+inline constexpr auto ping = make("");
+inline constexpr auto reset = make("+RESET");
+inline constexpr auto restoreDefaults = make("+ORGL");
+inline constexpr auto getName = make("+NAME");
+inline constexpr auto getPassword = make("+PSWD");
+inline constexpr auto getSerialParameters = make("+UART");
+inline constexpr auto getRole = make("+ROLE");
+inline constexpr auto getAddress = make("+ADDR?");
+
+constexpr Command<32> setSerialParameters(uint32_t baudRate, StopBit stopBit, Parity parity)
+{
+	Command<32> command;
+	command.append("AT+UART:").append(baudRate)
+		.append(",").append(static_cast<uint32_t>(stopBit))
+		.append(",").append(static_cast<uint32_t>(parity))
+		.append("\r\n");
+	return command;
+}
+
+constexpr Command<12> setRole(Role role)
+{
+	Command<12> command;
+	command.append("AT+ROLE=").append(static_cast<uint32_t>(role)).append("\r\n");
+	return command;
+}
+
+// the caller checks the length, name up to maxNameLength and pin of exactly pinLength characters
+constexpr Command<maxNameLength + 12> setName(std::string_view name)
+{
+	Command<maxNameLength + 12> command;
+	command.append("AT+NAME=\"").append(name).append("\"\r\n");
+	return command;
+}
+
+constexpr Command<pinLength + 12> setPassword(std::string_view pin)
+{
+	Command<pinLength + 12> command;
+	command.append("AT+PSWD=\"").append(pin).append("\"\r\n");
+	return command;
+}
+
+/** Answer parsing -----------------------------------------------------------*/
+// value of "<prefix><value>\r\n", the module puts OK\r\n after it
+constexpr bool field(std::string_view answer, std::string_view prefix, std::string_view& value)
+{
+	if(!answer.starts_with(prefix))
+	{
+		return false;
+	}
+
+	answer.remove_prefix(prefix.size());
+	const std::size_t end = answer.find('\r');
+	if(end == std::string_view::npos)
+	{
+		return false;
+	}
+
+	value = answer.substr(0, end);
+	return true;
+}
+
+constexpr bool parseNumber(std::string_view text, uint32_t base, uint32_t& number)
+{
+	if(text.empty())
+	{
+		return false;
+	}
+
+	number = 0;
+	for(char ch : text)
+	{
+		uint32_t digit;
+		if(ch >= '0' && ch <= '9')
+		{
+			digit = ch - '0';
+		}
+		else if(ch >= 'a' && ch <= 'f')
+		{
+			digit = ch - 'a' + 10;
+		}
+		else if(ch >= 'A' && ch <= 'F')
+		{
+			digit = ch - 'A' + 10;
+		}
+		else
+		{
+			return false;
+		}
+
+		if(digit >= base)
+		{
+			return false;
+		}
+		number = number * base + digit;
+	}
+
+	return true;
+}
+
+// the returned views point into answer
+constexpr bool parseName(std::string_view answer, std::string_view& name)
+{
+	// +NAME:<name>
+	return field(answer, "+NAME:", name) && !name.empty();
+}
+
+constexpr bool parsePassword(std::string_view answer, std::string_view& pin)
+{
+	// +PIN:"<pin>"
+	if(!field(answer, "+PIN:\"", pin) || !pin.ends_with('"'))
+	{
+		return false;
+	}
+
+	pin.remove_suffix(1);
+	return !pin.empty();
+}
+
+constexpr bool parseRole(std::string_view answer, Role& role)
+{
+	// +ROLE:<0|1|2>
+	std::string_view value;
+	uint32_t number = 0;
+	if(!field(answer, "+ROLE:", value) || !parseNumber(value, 10, number) || number > static_cast<uint32_t>(Role::SlaveLoop))
+	{
+		return false;
+	}
+
+	role = static_cast<Role>(number);
+	return true;
+}
+
+constexpr bool parseSerialParameters(std::string_view answer, SerialParameters& parameters)
+{
+	// +UART:<baud rate>,<stop bit>,<parity>
+	std::string_view value;
+	if(!field(answer, "+UART:", value))
+	{
+		return false;
+	}
+
+	const std::size_t firstComma = value.find(',');
+	const std::size_t secondComma = value.find(',', firstComma + 1);
+	if(firstComma == std::string_view::npos || secondComma == std::string_view::npos)
+	{
+		return false;
+	}
+
+	uint32_t baudRate = 0;
+	uint32_t stopBit = 0;
+	uint32_t parity = 0;
+	if(!parseNumber(value.substr(0, firstComma), 10, baudRate) ||
+	   !parseNumber(value.substr(firstComma + 1, secondComma - firstComma - 1), 10, stopBit) ||
+	   !parseNumber(value.substr(secondComma + 1), 10, parity) ||
+	   stopBit > static_cast<uint32_t>(StopBit::Two) || parity > static_cast<uint32_t>(Parity::Even))
+	{
+		return false;
+	}
+
+	parameters = SerialParameters{baudRate, static_cast<StopBit>(stopBit), static_cast<Parity>(parity)};
+	return true;
+}
+
+constexpr bool parseAddress(std::string_view answer, Address& address)
+{
+	// +ADDR:<nap>:<uap>:<lap> in hex without leading zeros, 16, 8 and 24 bits
+	std::string_view value;
+	if(!field(answer, "+ADDR:", value))
+	{
+		return false;
+	}
+
+	const std::size_t firstColon = value.find(':');
+	const std::size_t secondColon = value.find(':', firstColon + 1);
+	if(firstColon == std::string_view::npos || secondColon == std::string_view::npos)
+	{
+		return false;
+	}
+
+	uint32_t nap = 0;
+	uint32_t uap = 0;
+	uint32_t lap = 0;
+	if(!parseNumber(value.substr(0, firstColon), 16, nap) ||
+	   !parseNumber(value.substr(firstColon + 1, secondColon - firstColon - 1), 16, uap) ||
+	   !parseNumber(value.substr(secondColon + 1), 16, lap) ||
+	   nap > 0xFFFF || uap > 0xFF || lap > 0xFFFFFF)
+	{
+		return false;
+	}
+
+	const uint8_t bytes[6] = {
+		static_cast<uint8_t>(nap >> 8), static_cast<uint8_t>(nap),
+		static_cast<uint8_t>(uap),
+		static_cast<uint8_t>(lap >> 16), static_cast<uint8_t>(lap >> 8), static_cast<uint8_t>(lap)
+	};
+	constexpr char hexDigits[] = "0123456789abcdef";
+	for(std::size_t i = 0; i < 6; ++i)
+	{
+		address[i * 3] = hexDigits[bytes[i] >> 4];
+		address[i * 3 + 1] = hexDigits[bytes[i] & 0x0F];
+		if(i < 5)
+		{
+			address[i * 3 + 2] = ':';
+		}
+	}
+
+	return true;
+}
+
+static_assert(ping.view() == "AT\r\n");
+static_assert(setRole(Role::SlaveLoop).view() == "AT+ROLE=2\r\n");
+static_assert(setSerialParameters(38400, StopBit::One, Parity::None).view() == "AT+UART:38400,0,0\r\n");
+static_assert(setName("HC-05").view() == "AT+NAME=\"HC-05\"\r\n");
+static_assert(setPassword("1234").view() == "AT+PSWD=\"1234\"\r\n");
+static_assert([] { std::string_view name; return parseName("+NAME:HC-05\r\nOK\r\n", name) && name == "HC-05"; }());
+static_assert([] { std::string_view pin; return parsePassword("+PIN:\"1234\"\r\nOK\r\n", pin) && pin == "1234"; }());
+static_assert([] { Role role{}; return parseRole("+ROLE:2\r\nOK\r\n", role) && role == Role::SlaveLoop; }());
+static_assert([] {
+	SerialParameters parameters{};
+	return parseSerialParameters("+UART:38400,1,2\r\nOK\r\n", parameters) &&
+		parameters.baudRate == 38400 && parameters.stopBit == StopBit::Two && parameters.parity == Parity::Even;
+}());
+static_assert([] {
+	Address address{};
+	return parseAddress("+ADDR:98d3:31:f5b2a\r\nOK\r\n", address) && std::string_view(address.data(), address.size()) == "98:d3:31:0f:5b:2a";
+}());
+static_assert([] { Role role{}; return !parseRole("ERROR:(0)\r\n", role); }());
+
+} // namespace at
+
+/** Driver -------------------------------------------------------------------*/
+template<UartPolicy Uart, std::size_t RxSize, std::size_t TxSize>
+class Bluetooth
+{
+	static_assert(RxSize >= at::okResponse.size(), "RX storage must hold at least an OK response");
+
+public:
+	static constexpr uint32_t commandTimeout = 100; // ms
+
+	/* Collects a message in the TX storage and sends it in one transfer on commit().
+	 * Only one transaction can be open at a time, an uncommitted one is discarded
+	 * */
+	class Transaction
+	{
+	public:
+		explicit Transaction(Bluetooth& bluetooth) : owner(&bluetooth)
+		{
+			if(bluetooth.txOpen)
+			{
+				owner = nullptr;
+				return;
+			}
+			bluetooth.txOpen = true;
+			bluetooth.txLength = 0;
+		}
+
+		Transaction(const Transaction&) = delete;
+		Transaction& operator=(const Transaction&) = delete;
+
+		Transaction(Transaction&& other) noexcept : owner(other.owner)
+		{
+			other.owner = nullptr;
+		}
+
+		~Transaction()
+		{
+			if(owner != nullptr)
+			{
+				owner->txOpen = false;
+			}
+		}
+
+		explicit operator bool() const
+		{
+			return owner != nullptr;
+		}
+
+		bool append(std::span<const std::byte> data)
+		{
+			if(owner == nullptr || owner->txLength + data.size() > TxSize)
+			{
+				return false;
+			}
+
+			for(std::byte b : data)
+			{
+				owner->txStorage[owner->txLength++] = b;
+			}
+			return true;
+		}
+
+		Response commit(uint32_t timeout)
+		{
+			if(owner == nullptr)
+			{
+				return Response::Fail;
+			}
+
+			const Response response = owner->send(std::span<const std::byte>(owner->txStorage.data(), owner->txLength), timeout);
+			owner->txOpen = false;
+			owner = nullptr;
+
+			return response;
+		}
+
+	private:
+		Bluetooth* owner;
+	};
+
+	explicit Bluetooth(Uart transport) : uart(transport) {}
+
+	Bluetooth(const Bluetooth&) = delete;
+	Bluetooth& operator=(const Bluetooth&) = delete;
+
+	template<std::size_t N>
+	Response command(const Command<N>& command)
+	{
+		if(!uart.transmit(command.bytes(), commandTimeout))
+		{
+			return Response::Fail;
+		}
+
+		const std::span<std::byte> answer(rxStorage.data(), at::okResponse.size());
+		if(uart.receive(answer, commandTimeout) != answer.size())
+		{
+			return Response::Fail;
+		}
+
+		const std::string_view answerText(reinterpret_cast<const char*>(answer.data()), answer.size());
+		return answerText == at::okResponse ? Response::Ok : Response::Fail;
+	}
+
+	Response ping()
+	{
+		return command(at::ping);
+	}
+
+	Response setRole(Role role)
+	{
+		return command(at::setRole(role));
+	}
+
+	Response setSerialParameters(uint32_t baudRate, StopBit stopBit, Parity parity)
+	{
+		return command(at::setSerialParameters(baudRate, stopBit, parity));
+	}
+
+	/* Sends a query and collects the answer in the RX storage until the module ends it with OK or ERROR.
+	 * answer points into the RX storage and stays valid until the next receive
+	 * */
+	template<std::size_t N>
+	Response query(const Command<N>& command, std::string_view& answer)
+	{
+		if(!uart.transmit(command.bytes(), commandTimeout))
+		{
+			return Response::Fail;
+		}
+
+		std::size_t length = 0;
+		while(length < RxSize)
+		{
+			if(uart.receive(std::span<std::byte>(rxStorage.data() + length, 1), commandTimeout) != 1)
+			{
+				return Response::Fail;
+			}
+			++length;
+
+			const std::string_view text(reinterpret_cast<const char*>(rxStorage.data()), length);
+			if(text.ends_with(at::okResponse))
+			{
+				answer = text;
+				return Response::Ok;
+			}
+			if(text.starts_with(at::errorResponse) && text.ends_with("\r\n"))
+			{
+				return Response::Fail;
+			}
+		}
+
+		// the answer does not fit into RxSize
+		return Response::Fail;
+	}
+
+	// the name view points into the RX storage and stays valid until the next receive
+	Response getName(std::string_view& name)
+	{
+		std::string_view answer;
+		return query(at::getName, answer) == Response::Ok && at::parseName(answer, name) ? Response::Ok : Response::Fail;
+	}
+
+	Response setName(std::string_view name)
+	{
+		if(name.empty() || name.size() > at::maxNameLength)
+		{
+			return Response::Fail;
+		}
+		return command(at::setName(name));
+	}
+
+	// the pin view points into the RX storage and stays valid until the next receive
+	Response getPassword(std::string_view& pin)
+	{
+		std::string_view answer;
+		return query(at::getPassword, answer) == Response::Ok && at::parsePassword(answer, pin) ? Response::Ok : Response::Fail;
+	}
+
+	Response setPassword(std::string_view pin)
+	{
+		if(pin.size() != at::pinLength)
+		{
+			return Response::Fail;
+		}
+		return command(at::setPassword(pin));
+	}
+
+	Response getSerialParameters(SerialParameters& parameters)
+	{
+		std::string_view answer;
+		return query(at::getSerialParameters, answer) == Response::Ok && at::parseSerialParameters(answer, parameters) ? Response::Ok : Response::Fail;
+	}
+
+	Response getRole(Role& role)
+	{
+		std::string_view answer;
+		return query(at::getRole, answer) == Response::Ok && at::parseRole(answer, role) ? Response::Ok : Response::Fail;
+	}
+
+	Response getAddress(Address& address)
+	{
+		std::string_view answer;
+		return query(at::getAddress, answer) == Response::Ok && at::parseAddress(answer, address) ? Response::Ok : Response::Fail;
+	}
+
+	// the data is handed to the transport as is, without a copy
+	Response send(std::span<const std::byte> data, uint32_t timeout)
+	{
+		return uart.transmit(data, timeout) ? Response::Ok : Response::Fail;
+	}
+
+	// the returned view points into the RX storage and stays valid until the next receive
+	std::span<const std::byte> receive(std::size_t length, uint32_t timeout)
+	{
+		if(length > RxSize)
+		{
+			length = RxSize;
+		}
+
+		std::size_t received = uart.receive(std::span<std::byte>(rxStorage.data(), length), timeout);
+		if(received > length)
+		{
+			received = length;
+		}
+
+		return std::span<const std::byte>(rxStorage.data(), received);
+	}
+
+	Transaction transaction() requires (TxSize > 0)
+	{
+		return Transaction(*this);
+	}
+
+private:
+	Uart uart;
+	std::array<std::byte, RxSize> rxStorage{};
+	std::array<std::byte, TxSize> txStorage{};
+	std::size_t txLength = 0;
+	bool txOpen = false;
+};
+
+} // namespace bluetooth
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _BLUETOOTH_CHANNEL_H__
+#define _BLUETOOTH_CHANNEL_H__
+
+#include "bluetooth.h"
+
+#define BLUETOOTH_CHANNEL_COUNT 4
+#define BLUETOOTH_CHANNEL_MAX_PAYLOAD 64
+#define BLUETOOTH_CHANNEL_TX_QUEUE_SIZE 4
+#define BLUETOOTH_CHANNEL_RX_BUFFER_SIZE 128
+#define BLUETOOTH_CHANNEL_DEFAULT_QUANTUM BLUETOOTH_CHANNEL_MAX_PAYLOAD
+#define BLUETOOTH_CHANNEL_RX_RING_SIZE 256
+#define BLUETOOTH_CHANNEL_SYNC_TIMEOUT 50 // ms a channel may stay out of credits before it resyncs
+
+/* Frame format on the link:
+ * 0xA5 | channel | payload length | payload | xor of channel, length and payload
+ * Data frames start their payload with the 2-byte stream offset of their first byte.
+ * Channel ids with bit 7 set carry the receiver's cumulative consumed byte count (credit grant),
+ * with bit 6 set the sender's cumulative sent byte count (sync), both 2 bytes, modulo 65536.
+ * Counters are cumulative, so a lost data, grant or sync frame is made up for by the next one
+ * */
+
+typedef struct
+{
+	const uint8_t *data;
+	uint16_t length;
+	uint16_t offset;
+	uint32_t enqueueCycles;
+}bluetooth_channelMessage;
+
+typedef struct
+{
+	uint32_t bytesSent;
+	uint32_t framesSent;
+	uint32_t bytesReceived;
+	uint32_t rxOverflows;
+	uint32_t rxLostBytes; // announced by the peer but never delivered, already returned as credit
+	uint32_t creditStalls;
+	uint32_t resyncs;
+	uint32_t maxLatencyUs; // from bluetooth_channelSend until the last frame of the message was sent
+}bluetooth_channelStats;
+
+typedef struct
+{
+	/* TX side, scheduled with deficit round-robin */
+	bluetooth_channelMessage txQueue[BLUETOOTH_CHANNEL_TX_QUEUE_SIZE];
+	uint8_t txHead;
+	uint8_t txCount;
+	uint16_t quantum;
+	uint16_t deficit;
+	uint16_t txTotal; // bytes ever sent on this channel
+	uint16_t peerConsumed; // latest grant: bytes the peer has consumed or written off
+	bool stalled;
+	uint32_t stallTick;
+
+	/* RX side */
+	uint8_t rxBuffer[BLUETOOTH_CHANNEL_RX_BUFFER_SIZE];
+	uint16_t rxHead;
+	uint16_t rxCount;
+	uint16_t rxTotal; // bytes of the peer stream accounted for, delivered or lost
+	uint16_t grantedTotal; // last consumed count sent to the peer
+	bool grantRequested;
+
+	bluetooth_channelStats stats;
+}bluetooth_channel;
+
+typedef struct
+{
+	bluetooth_handler_t *bluetooth;
+	bluetooth_channel channels[BLUETOOTH_CHANNEL_COUNT];
+	uint8_t currentChannel;
+
+	uint8_t txFrame[BLUETOOTH_CHANNEL_MAX_PAYLOAD + 6];
+	uint8_t rxRing[BLUETOOTH_CHANNEL_RX_RING_SIZE];
+
+	uint8_t rxState;
+	uint8_t rxChannel;
+	uint8_t rxLength;
+	uint8_t rxIndex;
+	uint8_t rxChecksum;
+	uint8_t rxPayload[BLUETOOTH_CHANNEL_MAX_PAYLOAD + 2];
+	uint32_t rxBadFrames;
+}bluetooth_channelMux;
+
+Bluetooth_response bluetooth_channelInit(bluetooth_channelMux *mux, bluetooth_handler_t *bluetooth);
+Bluetooth_response bluetooth_channelDeinit(bluetooth_channelMux *mux);
+Bluetooth_response bluetooth_channelSetQuantum(bluetooth_channelMux *mux, uint8_t channel, uint16_t quantum);
+
+Bluetooth_response bluetooth_channelSend(bluetooth_channelMux *mux, uint8_t channel, const uint8_t *data, uint16_t length);
+uint16_t bluetooth_channelRead(bluetooth_channelMux *mux, uint8_t channel, uint8_t *data, uint16_t maxLength);
+
+void bluetooth_channelFeed(bluetooth_channelMux *mux, const uint8_t *data, uint16_t length);
+Bluetooth_response bluetooth_channelPoll(bluetooth_channelMux *mux, uint32_t timeout);
+
+void bluetooth_channelGetStats(bluetooth_channelMux *mux, uint8_t channel, bluetooth_channelStats *stats);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _BLUETOOTH_SELFTEST_H__
+#define _BLUETOOTH_SELFTEST_H__
+
+#include "bluetooth.h"
+
+#define BLUETOOTH_SELFTEST_MAX_PACKET_SIZE 128
+#define BLUETOOTH_SELFTEST_MAX_PACKET_COUNT 64
+#define BLUETOOTH_SELFTEST_PIPELINE_DEPTH 4 // packets queued at once in the pipelined phase
+#define BLUETOOTH_SELFTEST_STREAM_RING_SIZE 512
+
+/* The remote module has to be in BLUETOOTH_SLAVE_LOOP_ROLE (see bluetooth_setModuleRole),
+ * so everything sent over the link comes straight back
+ * */
+typedef struct
+{
+	uint16_t packetSize;
+	uint16_t packetCount;
+	uint32_t seed;
+	uint32_t timeout; // ms, for a single round trip, or without any echo in the pipelined phase
+}bluetooth_selfTestConfig;
+
+typedef struct
+{
+	uint16_t packetsSent;
+	uint16_t packetsLost;
+
+	uint32_t bytesCompared;
+	uint32_t byteErrors;
+	uint32_t bitErrors; // out of 8 * bytesCompared
+
+	uint32_t latencyP50Us;
+	uint32_t latencyP90Us;
+	uint32_t latencyP99Us;
+	uint32_t latencyMaxUs;
+
+	/* One packet in flight at a time: echoed payload bytes divided by the summed round trip times.
+	 * This is the stop-and-wait rate, a lower bound of what a pipelined stream would reach
+	 * */
+	uint32_t stopAndWaitBytesPerSecond;
+
+	/* Pipelined phase: the same number of packets queued back-to-back, the echo compared as it streams in.
+	 * A lost byte shifts the rest of the echo, so it shows up as byte errors after it and one missing byte
+	 * */
+	uint32_t pipelinedBytesCompared;
+	uint32_t pipelinedByteErrors;
+	uint32_t pipelinedBytesMissing; // never echoed before the timeout
+	uint32_t pipelinedBytesPerSecond; // sustained rate: echoed bytes divided by the time from the first send to the last echo
+}bluetooth_selfTestResult;
+
+Bluetooth_response bluetooth_runSelfTest(bluetooth_handler_t *bluetooth, const bluetooth_selfTestConfig *config, bluetooth_selfTestResult *result);
+
+#endif
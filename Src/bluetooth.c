@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #define OK_RESPONSE_SIZE 4
 #define TIMEOUT 100
@@ -15,16 +16,102 @@
 #define GET_NAME_RESPONSE_SIZE 30
 #define BLUETOOTH_MODULE_ADDRESS_RESPONSE 26
 #define BLUETOOTH_MODULE_ROLE_RESPONSE_LENGTH 13
+#define SET_MODULE_ROLE_COMMAND_LENGTH 12
+#define CONFIG_SNAPSHOT_MAGIC 0x48433035UL // "HC05"
+#define CRC32_POLYNOMIAL 0xEDB88320UL
+#define UART_SR_ERROR_FLAGS (USART_SR_ORE | USART_SR_FE | USART_SR_NE | USART_SR_PE)
+#define LINE_DELIMITER "\r\n"
+
+/* Word-at-a-time (SWAR) constants, one byte lane per char in a 32-bit word */
+#define SWAR_ONES 0x01010101UL
+#define SWAR_HIGHS 0x80808080UL
+
+enum Bluetooth_rxMode
+{
+	RX_MODE_NONE,
+	RX_MODE_IT,
+	RX_MODE_DMA,
+	RX_MODE_TO_IDLE,
+	RX_MODE_EXCHANGE, // bluetooth_exchangeData, into the caller buffer, without events
+	RX_MODE_STREAM // bluetooth_startRxStream, chunks copied into the caller ring, re-armed at once
+};
 
 static const char* OK_RESPONSE = "OK\r\n";
+static const char* ERROR_RESPONSE = "ERROR";
+
+typedef struct
+{
+	bluetooth_eventHandler handler;
+	void *context;
+}bluetooth_eventSubscription;
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	bluetooth_moduleConfig config;
+	uint32_t crc;
+}bluetooth_configSnapshot;
+
+typedef struct
+{
+	const uint8_t *data;
+	uint16_t length;
+	uint16_t offset;
+	uint32_t enqueueCycles;
+}bluetooth_txEntry;
+
+typedef struct
+{
+	bluetooth_txEntry entries[BLUETOOTH_TX_QUEUE_SIZE];
+	uint8_t head;
+	uint8_t count;
+	bluetooth_txStats stats;
+}bluetooth_txQueue;
 
 struct bluetooth_handler_t
 {
 	UART_HandleTypeDef *uart_handler;
+
+	/* Bytes received past the last delimiter are kept here for the next read */
+	uint8_t lineBuffer[BLUETOOTH_LINE_BUFFER_SIZE];
+	uint16_t lineBufferLength;
+
+	/* Filled from the HAL callbacks, drained by bluetooth_processEvents */
+	bluetooth_event eventQueue[BLUETOOTH_EVENT_QUEUE_SIZE];
+	volatile uint16_t eventHead;
+	volatile uint16_t eventTail;
+	bluetooth_eventSubscription subscriptions[BLUETOOTH_EVENT_COUNT];
+	volatile bluetooth_eventStats eventStats;
+
+	/* Queued transfers, one DMA transfer (a whole HIGH message or one BULK chunk) in flight at a time */
+	bluetooth_txQueue txQueues[BLUETOOTH_TX_PRIORITY_COUNT];
+	volatile bool txInFlight;
+	Bluetooth_txPriority txInFlightPriority;
+	uint16_t txInFlightLength;
+
+	/* Reception started with bluetooth_readMessage_xxx, kept to re-arm it after an error.
+	 * It lands in receiveBuffer: bluetooth_interruptBuffer for the first instance, instanceReceiveBuffer for the others
+	 * */
+	bluetooth_receivedDataBuffer *receiveBuffer;
+	bluetooth_receivedDataBuffer instanceReceiveBuffer;
+	volatile uint8_t rxMode;
+	uint16_t rxLength;
+	volatile bluetooth_uartErrorStats uartErrorStats;
+
+	/* Continuous reception: DMA fills streamChunk, the callback moves it into the caller ring */
+	uint8_t streamChunk[BLUETOOTH_RX_STREAM_CHUNK_SIZE];
+	uint8_t *streamRing;
+	uint16_t streamRingSize;
+	volatile uint16_t streamHead;
+	volatile uint16_t streamTail;
 };
 
 bluetooth_receivedDataBuffer bluetooth_interruptBuffer = {.isDataReady = false, .dataEnd = 0};
 
+static bluetooth_handler_t* instances[BLUETOOTH_MAX_INSTANCES];
+
 /** Static Functions -------------------------------------------------------- */
 static bool startsWith(char* word, char* pattern)
 {
@@ -282,289 +369,1478 @@ static uint8_t getParity(char* response)
 	return parity;
 }
 
-/** Functions ----------------------------------------------------------------*/
-bluetooth_handler_t* bluetooth_init(UART_HandleTypeDef *huart)
+static uint16_t findByte(const uint8_t* data, uint16_t length, uint8_t byte)
 {
-	bluetooth_handler_t *bluetooth = malloc(sizeof(bluetooth_handler_t));
+	const uint32_t pattern = SWAR_ONES * byte;
+	uint16_t i = 0;
 
-	if(bluetooth != NULL)
+	/* Compare four bytes at once: (word ^ pattern) has a zero byte lane
+	 * exactly where data matches, and the classic haszero trick detects it.
+	 * The byte loop below then pins down the position inside the word.
+	 * */
+	while(i + sizeof(uint32_t) <= length)
 	{
-		bluetooth->uart_handler = huart;
+		uint32_t word;
+		memcpy(&word, data + i, sizeof(word));
+		word ^= pattern;
+
+		if(((word - SWAR_ONES) & ~word & SWAR_HIGHS) != 0)
+		{
+			break;
+		}
+
+		i += sizeof(uint32_t);
 	}
-	return bluetooth;
-}
 
-void bluetooth_destroy(bluetooth_handler_t* bluetooth)
-{
-	if(bluetooth)
+	while(i < length && data[i] != byte)
 	{
-		free(bluetooth);
+		++i;
 	}
+
+	return i;
 }
 
-Bluetooth_response bluetooth_pingDevice(bluetooth_handler_t* bluetooth)
+static uint16_t findDelimiter(const uint8_t* data, uint16_t length, uint16_t begin, const char* delimiter, uint8_t delimiterLength)
 {
-	assert(bluetooth != NULL);
-
-	if(bluetooth->uart_handler == NULL)
+	// returns position of the delimiter or length if the delimiter is not (yet) complete
+	uint16_t pos = begin;
+	while(pos < length)
 	{
-		return BLUETOOTH_FAIL;
+		pos += findByte(data + pos, length - pos, (uint8_t)delimiter[0]);
+
+		if(pos + delimiterLength > length)
+		{
+			break;
+		}
+
+		if(memcmp(data + pos, delimiter, delimiterLength) == 0)
+		{
+			return pos;
+		}
+
+		++pos;
 	}
 
-	const char* test_command = "AT\r\n";
-	const uint8_t command_length = strlen(test_command);
-	const uint16_t timeout = 100; // ms
+	return length;
+}
 
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)test_command, command_length, timeout);
+static void consumeLineBuffer(bluetooth_handler_t *bluetooth, uint16_t count)
+{
+	bluetooth->lineBufferLength -= count;
+	memmove(bluetooth->lineBuffer, bluetooth->lineBuffer + count, bluetooth->lineBufferLength);
+}
 
-	char response[OK_RESPONSE_SIZE + 1];
-	response[OK_RESPONSE_SIZE] = '\0';
+static uint32_t takeFromLineBuffer(bluetooth_handler_t *bluetooth, uint8_t* data, uint32_t maxLength)
+{
+	const uint32_t count = bluetooth->lineBufferLength < maxLength ? bluetooth->lineBufferLength : maxLength;
 
-	HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)response, OK_RESPONSE_SIZE, timeout);
+	memcpy(data, bluetooth->lineBuffer, count);
+	consumeLineBuffer(bluetooth, count);
 
-	if(strcmp(response, OK_RESPONSE) == 0)
+	return count;
+}
+
+static void countUartErrors(bluetooth_handler_t *bluetooth, uint32_t errorCode)
+{
+	if(errorCode & HAL_UART_ERROR_ORE)
 	{
-		return BLUETOOTH_OK;
+		++bluetooth->uartErrorStats.overrunErrors;
+		++bluetooth->uartErrorStats.lostBytes;
 	}
-	else
+	if(errorCode & HAL_UART_ERROR_FE)
 	{
-		return BLUETOOTH_FAIL;
+		++bluetooth->uartErrorStats.framingErrors;
+	}
+	if(errorCode & HAL_UART_ERROR_NE)
+	{
+		++bluetooth->uartErrorStats.noiseErrors;
+	}
+	if(errorCode & HAL_UART_ERROR_PE)
+	{
+		++bluetooth->uartErrorStats.parityErrors;
+	}
+	if(errorCode & HAL_UART_ERROR_DMA)
+	{
+		++bluetooth->uartErrorStats.dmaErrors;
 	}
 }
 
-Bluetooth_response bluetooth_setUartBaudrate(bluetooth_handler_t* bluetooth, uint32_t newBaudrate)
+static void checkBlockingUartErrors(bluetooth_handler_t *bluetooth)
 {
-	assert(newBaudrate != 0);
-
-	bluetooth->uart_handler->Instance->CR1 &= ~(USART_CR1_UE);
-	bluetooth->uart_handler->Instance->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK2Freq(), newBaudrate);
-	bluetooth->uart_handler->Instance->CR1 |= USART_CR1_UE;
+	/* Blocking HAL_UART_Receive does not look at the error flags, so they are only counted here.
+	 * Clearing them would read DR and throw away the byte that is waiting there,
+	 * the receive itself reads DR after this SR read and that clears them
+	 * */
+	const uint32_t statusRegister = bluetooth->uart_handler->Instance->SR;
+	if((statusRegister & UART_SR_ERROR_FLAGS) == 0)
+	{
+		return;
+	}
 
-	bluetooth->uart_handler->Init.BaudRate = newBaudrate;
+	uint32_t errorCode = HAL_UART_ERROR_NONE;
+	if(statusRegister & USART_SR_ORE)
+	{
+		errorCode |= HAL_UART_ERROR_ORE;
+	}
+	if(statusRegister & USART_SR_FE)
+	{
+		errorCode |= HAL_UART_ERROR_FE;
+	}
+	if(statusRegister & USART_SR_NE)
+	{
+		errorCode |= HAL_UART_ERROR_NE;
+	}
+	if(statusRegister & USART_SR_PE)
+	{
+		errorCode |= HAL_UART_ERROR_PE;
+	}
 
-	return BLUETOOTH_OK;
+	countUartErrors(bluetooth, errorCode);
 }
 
-Bluetooth_response bluetooth_setSerialParameters(bluetooth_handler_t* bluetooth, bluetooth_SerialParameters serialParam)
+static HAL_StatusTypeDef fillLineBuffer(bluetooth_handler_t *bluetooth, uint32_t timeout)
 {
-	assert(serialParam.baudRate != 0);
-	assert(serialParam.stopBit == STOP_BIT_1 || serialParam.stopBit == STOP_BIT_2);
-	assert(serialParam.parity == PARITY_ODD || serialParam.parity == PARITY_EVEN || serialParam.parity == PARITY_NONE);
-	assert(bluetooth->uart_handler);
-
-	/*Message is in format:
-	 * AT+UART:baud_rate,stop_bit,parity_bit\r\n
+	/* One call takes a whole burst: it waits for the first byte and returns once the line goes idle
+	 * or the buffer is full, so the delimiter search scans blocks instead of single bytes
 	 * */
-	uint8_t serialParameterCommand[MINIMAL_SET_SERIAL_PARAMETER_LENGTH];
-	memset(serialParameterCommand, 0, sizeof(serialParameterCommand));
-
-	uint8_t commandLength = sprintf((char*)serialParameterCommand, "AT+UART:%u,%u,%u\r\n", serialParam.baudRate, serialParam.stopBit, serialParam.parity);
+	UART_HandleTypeDef *huart = bluetooth->uart_handler;
+	const uint16_t room = BLUETOOTH_LINE_BUFFER_SIZE - bluetooth->lineBufferLength;
+	uint16_t received = 0;
 
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)serialParameterCommand, commandLength, TIMEOUT);
+	checkBlockingUartErrors(bluetooth);
 
-	char* answer[OK_RESPONSE_SIZE + 1];
-	HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)answer, OK_RESPONSE_SIZE, TIMEOUT);
-	answer[OK_RESPONSE_SIZE] = '\0';
+	const HAL_StatusTypeDef status = HAL_UARTEx_ReceiveToIdle(huart, bluetooth->lineBuffer + bluetooth->lineBufferLength, room, &received, timeout);
 
-	if(strcmp((const char*)answer, OK_RESPONSE) == 0)
-	{
-		return BLUETOOTH_OK;
-	}
-	else
+	// after a timeout RxXferCount still belongs to this reception, the bytes that made it are kept for the next read
+	if(status == HAL_TIMEOUT && huart->RxXferCount <= room)
 	{
-		return BLUETOOTH_FAIL;
+		received = room - huart->RxXferCount;
 	}
+	bluetooth->lineBufferLength += received;
+
+	return status;
 }
 
-Bluetooth_response bluetooth_getSerialParameters(bluetooth_handler_t *bluetooth, bluetooth_SerialParameters *serialParam)
+static bool registerInstance(bluetooth_handler_t *bluetooth)
 {
-	assert(bluetooth);
-	assert(bluetooth->uart_handler);
-	assert(serialParam);
-
-	const char* currentBaudrate = "AT+UART\r\n";
-	const int command_length = strlen(currentBaudrate);
+	for(uint8_t i = 0; i < BLUETOOTH_MAX_INSTANCES; ++i)
+	{
+		if(instances[i] == NULL)
+		{
+			instances[i] = bluetooth;
+			return true;
+		}
+	}
 
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)currentBaudrate, command_length, TIMEOUT);
+	return false;
+}
 
-	char response[100];
-	memset(response, 0, sizeof(response));
-	uint8_t currentIndex = 0;
-	uint8_t pickedChar = 0;
-	while(HAL_UART_Receive(bluetooth->uart_handler, &pickedChar, 1, TIMEOUT) != HAL_TIMEOUT)
+static void unregisterInstance(bluetooth_handler_t *bluetooth)
+{
+	for(uint8_t i = 0; i < BLUETOOTH_MAX_INSTANCES; ++i)
 	{
-		if(currentIndex >= 100)
+		if(instances[i] == bluetooth)
 		{
-			break;
+			instances[i] = NULL;
 		}
-
-		response[currentIndex++] = pickedChar;
 	}
-	response[currentIndex] = '\0';
+}
 
-	if(!isBluetoothResponseCorrect(response))
+static bluetooth_handler_t* findInstance(UART_HandleTypeDef *huart)
+{
+	for(uint8_t i = 0; i < BLUETOOTH_MAX_INSTANCES; ++i)
 	{
-		return BLUETOOTH_FAIL;
+		if(instances[i] != NULL && instances[i]->uart_handler == huart)
+		{
+			return instances[i];
+		}
 	}
 
-	serialParam->baudRate = getBaudRate(response);
-	serialParam->parity = getParity(response);
-	serialParam->stopBit = getStopBit(response);
-
-	return BLUETOOTH_OK;
+	return NULL;
 }
 
-Bluetooth_response bluetooth_restoreDefaultSettings(bluetooth_handler_t* bluetooth)
+static uint32_t enterCritical(void)
 {
-	assert(bluetooth);
-	assert(bluetooth->uart_handler);
-
-	char* restoreSettingsCommand = "AT+ORGL\r\n";
-	char restoreSettingsResponse[OK_RESPONSE_SIZE + 1];
+	const uint32_t primask = __get_PRIMASK();
+	__disable_irq();
 
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*) restoreSettingsCommand, strlen(restoreSettingsCommand), TIMEOUT);
-	HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*) restoreSettingsResponse, sizeof(restoreSettingsResponse), TIMEOUT);
+	return primask;
+}
 
-	if(strcmp(restoreSettingsResponse, OK_RESPONSE) != 0)
-	{
-		return BLUETOOTH_FAIL;
-	}
-	else
+static void exitCritical(uint32_t primask)
+{
+	if(!primask)
 	{
-		return BLUETOOTH_OK;
+		__enable_irq();
 	}
 }
 
-Bluetooth_response bluetooth_reset(bluetooth_handler_t *bluetooth)
+static void updateIsrCycles(bluetooth_handler_t *bluetooth, uint32_t cycleStart)
 {
-	char resetCommand[] = "AT+RESET\r\n";
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)resetCommand, sizeof(resetCommand), TIMEOUT) != HAL_OK)
+	const uint32_t cycles = DWT->CYCCNT - cycleStart;
+	if(cycles > bluetooth->eventStats.maxIsrCycles)
 	{
-		return BLUETOOTH_FAIL;
+		bluetooth->eventStats.maxIsrCycles = cycles;
 	}
+}
 
-	char resetResponse[OK_RESPONSE_SIZE + 1];
-	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)resetResponse, OK_RESPONSE_SIZE, TIMEOUT) != HAL_OK)
-	{
-		return BLUETOOTH_FAIL;
-	}
-	resetResponse[OK_RESPONSE_SIZE] = '\0';
+static void postEvent(bluetooth_handler_t *bluetooth, Bluetooth_eventType type, const uint8_t *data, uint16_t length, uint32_t errorCode)
+{
+	/* Callbacks of different priorities (UART, DMA, EXTI) may preempt each other,
+	 * so the queue slot is claimed with interrupts masked
+	 * */
+	const uint32_t primask = enterCritical();
 
-	if(strcmp(resetResponse, OK_RESPONSE) != 0)
+	const uint16_t nextHead = (bluetooth->eventHead + 1) % BLUETOOTH_EVENT_QUEUE_SIZE;
+	if(nextHead == bluetooth->eventTail)
 	{
-		return BLUETOOTH_FAIL;
+		++bluetooth->eventStats.droppedEvents;
 	}
 	else
 	{
-		return BLUETOOTH_OK;
+		bluetooth_event *event = &bluetooth->eventQueue[bluetooth->eventHead];
+		event->type = type;
+		event->data = data;
+		event->length = length;
+		event->errorCode = errorCode;
+		bluetooth->eventHead = nextHead;
+
+		++bluetooth->eventStats.queuedEvents;
+
+		const uint16_t depth = (nextHead + BLUETOOTH_EVENT_QUEUE_SIZE - bluetooth->eventTail) % BLUETOOTH_EVENT_QUEUE_SIZE;
+		if(depth > bluetooth->eventStats.maxQueueDepth)
+		{
+			bluetooth->eventStats.maxQueueDepth = depth;
+		}
 	}
+
+	exitCritical(primask);
 }
 
-Bluetooth_response bluetooth_sendMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t timeout)
+static void startNextTransfer(bluetooth_handler_t *bluetooth)
 {
-	assert(bluetooth);
-	assert(message);
-
-	uint8_t messageLength = strlen(message);
-
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)message, messageLength, timeout) == HAL_OK)
+	// must be called with interrupts masked or from the TX complete callback
+	if(bluetooth->txInFlight)
 	{
-		return BLUETOOTH_OK;
+		return;
 	}
-	else
+
+	/* Queues are served in priority order. BULK messages go out in chunks
+	 * so a HIGH message waits for at most one chunk, never a whole transfer
+	 * */
+	for(uint8_t priority = 0; priority < BLUETOOTH_TX_PRIORITY_COUNT; ++priority)
 	{
-		return BLUETOOTH_FAIL;
+		bluetooth_txQueue *queue = &bluetooth->txQueues[priority];
+		if(queue->count == 0)
+		{
+			continue;
+		}
+
+		const bluetooth_txEntry *entry = &queue->entries[queue->head];
+		uint16_t chunkLength = entry->length - entry->offset;
+		if(priority == BLUETOOTH_TX_PRIORITY_BULK && chunkLength > BLUETOOTH_TX_CHUNK_SIZE)
+		{
+			chunkLength = BLUETOOTH_TX_CHUNK_SIZE;
+		}
+
+		/* On failure the UART is busy with a direct transfer. An IT/DMA one restarts the queue
+		 * from its TX complete, a blocking one through transmitBlocking or bluetooth_processEvents
+		 * */
+		if(HAL_UART_Transmit_DMA(bluetooth->uart_handler, (uint8_t*)entry->data + entry->offset, chunkLength) == HAL_OK)
+		{
+			bluetooth->txInFlight = true;
+			bluetooth->txInFlightPriority = priority;
+			bluetooth->txInFlightLength = chunkLength;
+		}
+		return;
 	}
 }
 
-Bluetooth_response bluetooth_sendMessage_IT(bluetooth_handler_t *bluetooth, char* message)
+static bool finishTransfer(bluetooth_handler_t *bluetooth, const uint8_t **messageData, uint16_t *messageLength)
 {
-	assert(bluetooth);
-	assert(message);
+	// returns true when the transfer just finished was the last chunk of a queued message
+	bluetooth_txQueue *queue = &bluetooth->txQueues[bluetooth->txInFlightPriority];
+	bluetooth_txEntry *entry = &queue->entries[queue->head];
 
-	uint8_t length = strlen(message);
+	bluetooth->txInFlight = false;
+	entry->offset += bluetooth->txInFlightLength;
 
-	if(HAL_UART_Transmit_IT(bluetooth->uart_handler, (uint8_t*)message, length) == HAL_OK)
+	if(entry->offset < entry->length)
 	{
-		return BLUETOOTH_OK;
+		return false;
 	}
-	else
+
+	const uint32_t latency = bluetooth_cyclesToMicroseconds(DWT->CYCCNT - entry->enqueueCycles);
+	if(latency > queue->stats.maxLatencyUs)
 	{
-		return BLUETOOTH_FAIL;
+		queue->stats.maxLatencyUs = latency;
 	}
+	++queue->stats.sentMessages;
+	*messageData = entry->data;
+	*messageLength = entry->length;
+
+	queue->head = (queue->head + 1) % BLUETOOTH_TX_QUEUE_SIZE;
+	--queue->count;
+
+	return true;
 }
 
-Bluetooth_response bluetooth_sendMessage_DMA(bluetooth_handler_t *bluetooth, char* message)
+static void restartTxQueue(bluetooth_handler_t *bluetooth)
 {
-	assert(bluetooth);
-	assert(message);
+	// retries a queued transfer that could not start while the UART was busy
+	const uint32_t primask = enterCritical();
+	startNextTransfer(bluetooth);
+	exitCritical(primask);
+}
+
+static HAL_StatusTypeDef transmitBlocking(bluetooth_handler_t *bluetooth, uint8_t *data, uint16_t length, uint32_t timeout)
+{
+	// a blocking transmit ends without TX complete, so the queue is restarted here
+	const HAL_StatusTypeDef status = HAL_UART_Transmit(bluetooth->uart_handler, data, length, timeout);
+	restartTxQueue(bluetooth);
 
-	uint8_t length = strlen(message);
+	return status;
+}
+
+static HAL_StatusTypeDef startReception(bluetooth_handler_t *bluetooth, uint8_t mode, uint16_t length)
+{
+	HAL_StatusTypeDef status;
+	uint8_t* buffer = (uint8_t*)bluetooth->receiveBuffer->receivedData;
 
-	if(HAL_UART_Transmit_DMA(bluetooth->uart_handler, (uint8_t*)message, length) == HAL_OK)
+	switch(mode)
 	{
-		return BLUETOOTH_OK;
+	case RX_MODE_IT:
+		status = HAL_UART_Receive_IT(bluetooth->uart_handler, buffer, length);
+		break;
+	case RX_MODE_DMA:
+		status = HAL_UART_Receive_DMA(bluetooth->uart_handler, buffer, length);
+		break;
+	case RX_MODE_TO_IDLE:
+		status = HAL_UARTEx_ReceiveToIdle_DMA(bluetooth->uart_handler, buffer, length);
+		break;
+	case RX_MODE_STREAM:
+		status = HAL_UARTEx_ReceiveToIdle_DMA(bluetooth->uart_handler, bluetooth->streamChunk, length);
+		break;
+	default:
+		return HAL_ERROR;
 	}
-	else
+
+	if(status == HAL_OK)
 	{
-		return BLUETOOTH_FAIL;
+		bluetooth->rxMode = mode;
+		bluetooth->rxLength = length;
 	}
+
+	return status;
 }
 
-Bluetooth_response bluetooth_readMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, uint32_t timeout)
+static void pushStreamData(bluetooth_handler_t *bluetooth, uint16_t size)
 {
-	assert(bluetooth);
-	assert(message);
-	assert(maxMessageLength > 0);
-
-	uint32_t index = 0;
-	uint8_t ch;
-	while(HAL_UART_Receive(bluetooth->uart_handler, &ch, 1, timeout) != HAL_TIMEOUT)
+	// producer side of the stream ring, only ever called from the UART callbacks
+	for(uint16_t i = 0; i < size; ++i)
 	{
-		message[index++] = ch;
-		if(index == maxMessageLength - 1)
+		const uint16_t nextHead = (bluetooth->streamHead + 1) % bluetooth->streamRingSize;
+		if(nextHead == bluetooth->streamTail)
 		{
-			message[index] = '\0';
-			break;
+			bluetooth->uartErrorStats.lostBytes += size - i;
+			return;
 		}
-	}
 
-	return BLUETOOTH_OK;
+		bluetooth->streamRing[bluetooth->streamHead] = bluetooth->streamChunk[i];
+		bluetooth->streamHead = nextHead;
+	}
 }
 
-Bluetooth_response bluetooth_readMessage_IT(bluetooth_handler_t *bluetooth, uint32_t messageLength)
+static void recoverReception(bluetooth_handler_t *bluetooth, uint32_t cycleStart)
 {
-	assert(bluetooth);
-	assert(messageLength < BLUETOOTH_RECEIVED_DATA_BUFFER);
-
-	bluetooth_interruptBuffer.dataEnd = messageLength;
+	UART_HandleTypeDef *huart = bluetooth->uart_handler;
 
-	if(HAL_UART_Receive_IT(bluetooth->uart_handler, (uint8_t*)bluetooth_interruptBuffer.receivedData, messageLength) == HAL_OK)
+	/* Noise, framing and parity errors alone leave IT/DMA reception running.
+	 * Overruns and DMA errors make HAL abort it, then it is started again from the buffer start
+	 * */
+	if(bluetooth->rxMode == RX_MODE_NONE || huart->RxState != HAL_UART_STATE_READY)
 	{
-		return BLUETOOTH_OK;
+		return;
 	}
-	else
+
+	// an aborted exchange is reported as failed by bluetooth_exchangeData itself
+	if(bluetooth->rxMode == RX_MODE_EXCHANGE)
 	{
-		return BLUETOOTH_FAIL;
+		return;
 	}
-}
-
-Bluetooth_response bluetooth_readMessage_DMA(bluetooth_handler_t *bluetooth, uint32_t messageLength)
-{
-	assert(bluetooth);
-	assert(messageLength < BLUETOOTH_RECEIVED_DATA_BUFFER);
-
-	bluetooth_interruptBuffer.dataEnd = messageLength;
 
-	if(HAL_UART_Receive_DMA(bluetooth->uart_handler, (uint8_t*)bluetooth_interruptBuffer.receivedData, messageLength) == HAL_OK)
+	uint16_t remaining = huart->RxXferCount;
+	if(bluetooth->rxMode != RX_MODE_IT && huart->hdmarx != NULL)
 	{
-		return BLUETOOTH_OK;
+		remaining = __HAL_DMA_GET_COUNTER(huart->hdmarx);
 	}
-	else
+	if(remaining <= bluetooth->rxLength)
 	{
-		return BLUETOOTH_FAIL;
+		// the part of a stream chunk received before the abort is still good data
+		if(bluetooth->rxMode == RX_MODE_STREAM)
+		{
+			pushStreamData(bluetooth, bluetooth->rxLength - remaining);
+		}
+		else
+		{
+			bluetooth->uartErrorStats.lostBytes += bluetooth->rxLength - remaining;
+		}
 	}
-}
+
+	if(startReception(bluetooth, bluetooth->rxMode, bluetooth->rxLength) == HAL_OK)
+	{
+		++bluetooth->uartErrorStats.recoveries;
+
+		const uint32_t cycles = DWT->CYCCNT - cycleStart;
+		if(cycles > bluetooth->uartErrorStats.maxRecoveryCycles)
+		{
+			bluetooth->uartErrorStats.maxRecoveryCycles = cycles;
+		}
+	}
+	else
+	{
+		++bluetooth->uartErrorStats.failedRecoveries;
+		bluetooth->rxMode = RX_MODE_NONE;
+	}
+}
+
+static void recoverTransmission(bluetooth_handler_t *bluetooth)
+{
+	// a DMA error aborts the queued transfer without TX complete, the same chunk is sent again
+	if(bluetooth->txInFlight && bluetooth->uart_handler->gState == HAL_UART_STATE_READY)
+	{
+		bluetooth->txInFlight = false;
+		startNextTransfer(bluetooth);
+	}
+}
+
+static Bluetooth_eventType classifyReceivedData(bluetooth_handler_t *bluetooth, uint16_t length)
+{
+	// an AT command is finished once the module answered OK or ERROR
+	char* data = bluetooth->receiveBuffer->receivedData;
+
+	if(startsWith(data, (char*)ERROR_RESPONSE))
+	{
+		return BLUETOOTH_EVENT_COMMAND_COMPLETE;
+	}
+
+	if(length >= OK_RESPONSE_SIZE && endsWith(data, (char*)OK_RESPONSE))
+	{
+		return BLUETOOTH_EVENT_COMMAND_COMPLETE;
+	}
+
+	return BLUETOOTH_EVENT_DATA_RECEIVED;
+}
+
+static uint32_t crc32(const uint8_t *data, uint32_t length)
+{
+	uint32_t crc = 0xFFFFFFFFUL;
+	for(uint32_t i = 0; i < length; ++i)
+	{
+		crc ^= data[i];
+		for(uint8_t bit = 0; bit < 8; ++bit)
+		{
+			crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+static bool isSnapshotValid(const bluetooth_configSnapshot *snapshot)
+{
+	// a snapshot written by another firmware version is treated as missing
+	if(snapshot->magic != CONFIG_SNAPSHOT_MAGIC || snapshot->version != BLUETOOTH_CONFIG_SNAPSHOT_VERSION || snapshot->size != sizeof(bluetooth_configSnapshot))
+	{
+		return false;
+	}
+
+	return snapshot->crc == crc32((const uint8_t*)snapshot, offsetof(bluetooth_configSnapshot, crc));
+}
+
+static Bluetooth_response discoverConfig(bluetooth_handler_t *bluetooth, bluetooth_moduleConfig *config)
+{
+	memset(config, 0, sizeof(bluetooth_moduleConfig));
+
+	if(bluetooth_pingDevice(bluetooth) != BLUETOOTH_OK ||
+	   bluetooth_getSerialParameters(bluetooth, &config->serialParameters) != BLUETOOTH_OK ||
+	   bluetooth_getModuleRole(bluetooth, &config->role) != BLUETOOTH_OK ||
+	   bluetooth_getName(bluetooth, config->name) != BLUETOOTH_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	return BLUETOOTH_OK;
+}
+
+#ifdef BKPSRAM_BASE
+static bool backupSramRead(void *context, void *data, uint32_t size)
+{
+	// context is the byte offset of the snapshot inside backup SRAM
+	__HAL_RCC_BKPSRAM_CLK_ENABLE();
+	memcpy(data, (const void*)(BKPSRAM_BASE + (uintptr_t)context), size);
+
+	return true;
+}
+
+static bool backupSramWrite(void *context, const void *data, uint32_t size)
+{
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_EnableBkUpAccess();
+
+	// without the backup regulator the content survives resets but not the loss of VDD, even with VBAT present
+	if(HAL_PWREx_EnableBkUpReg() != HAL_OK)
+	{
+		return false;
+	}
+
+	__HAL_RCC_BKPSRAM_CLK_ENABLE();
+	memcpy((void*)(BKPSRAM_BASE + (uintptr_t)context), data, size);
+
+	return true;
+}
+
+const bluetooth_configStore bluetooth_backupSramStore = {.read = backupSramRead, .write = backupSramWrite, .context = NULL};
+#endif
+
+/** Functions ----------------------------------------------------------------*/
+bluetooth_handler_t* bluetooth_init(UART_HandleTypeDef *huart)
+{
+	bluetooth_handler_t *bluetooth = malloc(sizeof(bluetooth_handler_t));
+
+	if(bluetooth != NULL)
+	{
+		memset(bluetooth, 0, sizeof(bluetooth_handler_t));
+		bluetooth->uart_handler = huart;
+
+		if(!registerInstance(bluetooth))
+		{
+			free(bluetooth);
+			return NULL;
+		}
+
+		// code written for a single module keeps polling the global buffer, further instances get their own
+		bluetooth->receiveBuffer = instances[0] == bluetooth ? &bluetooth_interruptBuffer : &bluetooth->instanceReceiveBuffer;
+
+		bluetooth_enableCycleCounter();
+	}
+	return bluetooth;
+}
+
+void bluetooth_destroy(bluetooth_handler_t* bluetooth)
+{
+	if(bluetooth)
+	{
+		unregisterInstance(bluetooth);
+		free(bluetooth);
+	}
+}
+
+void bluetooth_enableCycleCounter(void)
+{
+	// latency and ISR timings are taken from the DWT cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t bluetooth_cyclesToMicroseconds(uint32_t cycles)
+{
+	return cycles / (SystemCoreClock / 1000000U);
+}
+
+Bluetooth_response bluetooth_pingDevice(bluetooth_handler_t* bluetooth)
+{
+	assert(bluetooth != NULL);
+
+	if(bluetooth->uart_handler == NULL)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	const char* test_command = "AT\r\n";
+	const uint8_t command_length = strlen(test_command);
+	const uint16_t timeout = 100; // ms
+
+	transmitBlocking(bluetooth, (uint8_t*)test_command, command_length, timeout);
+
+	char response[OK_RESPONSE_SIZE + 1];
+	response[OK_RESPONSE_SIZE] = '\0';
+
+	// HAL_BUSY while an IT/DMA reception or the RX stream owns the UART
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)response, OK_RESPONSE_SIZE, timeout) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	if(strcmp(response, OK_RESPONSE) == 0)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_startup(bluetooth_handler_t *bluetooth, const bluetooth_configStore *store, bluetooth_moduleConfig *config, bluetooth_startupReport *report)
+{
+	assert(bluetooth);
+	assert(store);
+	assert(config);
+
+	/* Warm start: a valid snapshot plus a single answered ping is enough.
+	 * Cold start: the full query sequence runs and its result becomes the new snapshot
+	 * */
+	const uint32_t tickStart = HAL_GetTick();
+	bluetooth_configSnapshot snapshot;
+	bool warmStart = false;
+
+	if(store->read(store->context, &snapshot, sizeof(snapshot)) && isSnapshotValid(&snapshot) &&
+	   bluetooth_pingDevice(bluetooth) == BLUETOOTH_OK)
+	{
+		*config = snapshot.config;
+		warmStart = true;
+	}
+	else
+	{
+		if(discoverConfig(bluetooth, config) != BLUETOOTH_OK)
+		{
+			return BLUETOOTH_FAIL;
+		}
+
+		// the module works, a failed write only costs a cold start next time
+		bluetooth_saveConfig(store, config);
+	}
+
+	if(report != NULL)
+	{
+		report->warmStart = warmStart;
+		report->startupTimeMs = HAL_GetTick() - tickStart;
+	}
+
+	return BLUETOOTH_OK;
+}
+
+Bluetooth_response bluetooth_saveConfig(const bluetooth_configStore *store, const bluetooth_moduleConfig *config)
+{
+	assert(store);
+	assert(config);
+
+	// call after changing the module settings, otherwise the next warm start restores stale values
+	bluetooth_configSnapshot snapshot;
+	memset(&snapshot, 0, sizeof(snapshot)); // padding is part of the CRC
+
+	snapshot.magic = CONFIG_SNAPSHOT_MAGIC;
+	snapshot.version = BLUETOOTH_CONFIG_SNAPSHOT_VERSION;
+	snapshot.size = sizeof(bluetooth_configSnapshot);
+	snapshot.config = *config;
+	snapshot.crc = crc32((const uint8_t*)&snapshot, offsetof(bluetooth_configSnapshot, crc));
+
+	if(store->write(store->context, &snapshot, sizeof(snapshot)))
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_setUartBaudrate(bluetooth_handler_t* bluetooth, uint32_t newBaudrate)
+{
+	assert(newBaudrate != 0);
+
+	bluetooth->uart_handler->Instance->CR1 &= ~(USART_CR1_UE);
+	bluetooth->uart_handler->Instance->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK2Freq(), newBaudrate);
+	bluetooth->uart_handler->Instance->CR1 |= USART_CR1_UE;
+
+	bluetooth->uart_handler->Init.BaudRate = newBaudrate;
+
+	return BLUETOOTH_OK;
+}
+
+Bluetooth_response bluetooth_setSerialParameters(bluetooth_handler_t* bluetooth, bluetooth_SerialParameters serialParam)
+{
+	assert(serialParam.baudRate != 0);
+	assert(serialParam.stopBit == STOP_BIT_1 || serialParam.stopBit == STOP_BIT_2);
+	assert(serialParam.parity == PARITY_ODD || serialParam.parity == PARITY_EVEN || serialParam.parity == PARITY_NONE);
+	assert(bluetooth->uart_handler);
+
+	/*Message is in format:
+	 * AT+UART:baud_rate,stop_bit,parity_bit\r\n
+	 * */
+	uint8_t serialParameterCommand[MINIMAL_SET_SERIAL_PARAMETER_LENGTH];
+	memset(serialParameterCommand, 0, sizeof(serialParameterCommand));
+
+	uint8_t commandLength = sprintf((char*)serialParameterCommand, "AT+UART:%u,%u,%u\r\n", serialParam.baudRate, serialParam.stopBit, serialParam.parity);
+
+	transmitBlocking(bluetooth, (uint8_t*)serialParameterCommand, commandLength, TIMEOUT);
+
+	char answer[OK_RESPONSE_SIZE + 1];
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)answer, OK_RESPONSE_SIZE, TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	answer[OK_RESPONSE_SIZE] = '\0';
+
+	if(strcmp(answer, OK_RESPONSE) == 0)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_getSerialParameters(bluetooth_handler_t *bluetooth, bluetooth_SerialParameters *serialParam)
+{
+	assert(bluetooth);
+	assert(bluetooth->uart_handler);
+	assert(serialParam);
+
+	const char* currentBaudrate = "AT+UART\r\n";
+	const int command_length = strlen(currentBaudrate);
+
+	transmitBlocking(bluetooth, (uint8_t*)currentBaudrate, command_length, TIMEOUT);
+
+	char response[100];
+	memset(response, 0, sizeof(response));
+	uint8_t currentIndex = 0;
+	uint8_t pickedChar = 0;
+	HAL_StatusTypeDef status = HAL_OK;
+	while(currentIndex < sizeof(response) - 1 && (status = HAL_UART_Receive(bluetooth->uart_handler, &pickedChar, 1, TIMEOUT)) == HAL_OK)
+	{
+		response[currentIndex++] = pickedChar;
+	}
+	response[currentIndex] = '\0';
+
+	// the answer ends with a timeout, HAL_BUSY means another reception owns the UART
+	if(status != HAL_TIMEOUT || currentIndex < OK_RESPONSE_SIZE)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	if(!isBluetoothResponseCorrect(response))
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	serialParam->baudRate = getBaudRate(response);
+	serialParam->parity = getParity(response);
+	serialParam->stopBit = getStopBit(response);
+
+	return BLUETOOTH_OK;
+}
+
+Bluetooth_response bluetooth_restoreDefaultSettings(bluetooth_handler_t* bluetooth)
+{
+	assert(bluetooth);
+	assert(bluetooth->uart_handler);
+
+	char* restoreSettingsCommand = "AT+ORGL\r\n";
+	char restoreSettingsResponse[OK_RESPONSE_SIZE + 1];
+
+	transmitBlocking(bluetooth, (uint8_t*) restoreSettingsCommand, strlen(restoreSettingsCommand), TIMEOUT);
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*) restoreSettingsResponse, OK_RESPONSE_SIZE, TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	restoreSettingsResponse[OK_RESPONSE_SIZE] = '\0';
+
+	if(strcmp(restoreSettingsResponse, OK_RESPONSE) != 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	else
+	{
+		return BLUETOOTH_OK;
+	}
+}
+
+Bluetooth_response bluetooth_reset(bluetooth_handler_t *bluetooth)
+{
+	char resetCommand[] = "AT+RESET\r\n";
+	if(transmitBlocking(bluetooth, (uint8_t*)resetCommand, sizeof(resetCommand), TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	char resetResponse[OK_RESPONSE_SIZE + 1];
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)resetResponse, OK_RESPONSE_SIZE, TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	resetResponse[OK_RESPONSE_SIZE] = '\0';
+
+	if(strcmp(resetResponse, OK_RESPONSE) != 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	else
+	{
+		return BLUETOOTH_OK;
+	}
+}
+
+Bluetooth_response bluetooth_sendMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(message);
+
+	uint8_t messageLength = strlen(message);
+
+	if(transmitBlocking(bluetooth, (uint8_t*)message, messageLength, timeout) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_sendMessage_IT(bluetooth_handler_t *bluetooth, char* message)
+{
+	assert(bluetooth);
+	assert(message);
+
+	// same as bluetooth_sendMessage_DMA, both go through the scheduler so HIGH messages keep their priority
+	return bluetooth_sendMessage_DMA(bluetooth, message);
+}
+
+Bluetooth_response bluetooth_sendMessage_DMA(bluetooth_handler_t *bluetooth, char* message)
+{
+	assert(bluetooth);
+	assert(message);
+
+	/* Queued as BULK, so a long message is sent in chunks and never holds up a HIGH one.
+	 * message is sent in place, it must stay untouched until BLUETOOTH_EVENT_TX_DONE reports it
+	 * */
+	const uint16_t length = strlen(message);
+	if(length == 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	return bluetooth_queueMessage(bluetooth, (const uint8_t*)message, length, BLUETOOTH_TX_PRIORITY_BULK);
+}
+
+Bluetooth_response bluetooth_queueMessage(bluetooth_handler_t *bluetooth, const uint8_t* data, uint16_t length, Bluetooth_txPriority priority)
+{
+	assert(bluetooth);
+	assert(data);
+	assert(length > 0);
+	assert(priority < BLUETOOTH_TX_PRIORITY_COUNT);
+
+	/* data is sent straight from the caller buffer, it must stay untouched
+	 * until BLUETOOTH_EVENT_TX_DONE reports this data pointer
+	 * */
+	bluetooth_txQueue *queue = &bluetooth->txQueues[priority];
+
+	const uint32_t primask = enterCritical();
+
+	if(queue->count == BLUETOOTH_TX_QUEUE_SIZE)
+	{
+		++queue->stats.rejectedMessages;
+		exitCritical(primask);
+		return BLUETOOTH_FAIL;
+	}
+
+	bluetooth_txEntry *entry = &queue->entries[(queue->head + queue->count) % BLUETOOTH_TX_QUEUE_SIZE];
+	entry->data = data;
+	entry->length = length;
+	entry->offset = 0;
+	entry->enqueueCycles = DWT->CYCCNT;
+
+	++queue->count;
+	++queue->stats.queuedMessages;
+	if(queue->count > queue->stats.maxQueueDepth)
+	{
+		queue->stats.maxQueueDepth = queue->count;
+	}
+
+	startNextTransfer(bluetooth);
+
+	exitCritical(primask);
+
+	return BLUETOOTH_OK;
+}
+
+void bluetooth_getTxStats(bluetooth_handler_t *bluetooth, Bluetooth_txPriority priority, bluetooth_txStats *stats)
+{
+	assert(bluetooth);
+	assert(priority < BLUETOOTH_TX_PRIORITY_COUNT);
+	assert(stats);
+
+	const uint32_t primask = enterCritical();
+	*stats = bluetooth->txQueues[priority].stats;
+	stats->queueDepth = bluetooth->txQueues[priority].count;
+	exitCritical(primask);
+}
+
+Bluetooth_response bluetooth_sendData(bluetooth_handler_t *bluetooth, const uint8_t* data, uint16_t length, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(data);
+
+	// unlike bluetooth_sendMessage the payload may contain '\0'
+	if(transmitBlocking(bluetooth, (uint8_t*)data, length, timeout) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_readMessage(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(message);
+	assert(maxMessageLength > 0);
+
+	// data left over by bluetooth_readUntil comes first
+	uint32_t index = takeFromLineBuffer(bluetooth, (uint8_t*)message, maxMessageLength - 1);
+	uint8_t ch;
+	HAL_StatusTypeDef status = HAL_OK;
+	while(index < maxMessageLength - 1)
+	{
+		checkBlockingUartErrors(bluetooth);
+
+		status = HAL_UART_Receive(bluetooth->uart_handler, &ch, 1, timeout);
+		if(status != HAL_OK)
+		{
+			break;
+		}
+
+		message[index++] = ch;
+	}
+	message[index] = '\0';
+
+	// a timeout ends the message, HAL_BUSY means a pending IT/DMA reception or the RX stream owns the UART
+	if(status != HAL_OK && status != HAL_TIMEOUT)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	return BLUETOOTH_OK;
+}
+
+Bluetooth_response bluetooth_readData(bluetooth_handler_t *bluetooth, uint8_t* data, uint16_t length, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(data);
+
+	// succeeds only when exactly length bytes arrived within timeout
+	const uint16_t buffered = takeFromLineBuffer(bluetooth, data, length);
+	if(buffered == length)
+	{
+		return BLUETOOTH_OK;
+	}
+
+	checkBlockingUartErrors(bluetooth);
+
+	if(HAL_UART_Receive(bluetooth->uart_handler, data + buffered, length - buffered, timeout) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_exchangeData(bluetooth_handler_t *bluetooth, const uint8_t* txData, uint8_t* rxData, uint16_t length, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(txData);
+	assert(rxData);
+
+	/* Reception is armed in interrupt mode before the first byte goes out,
+	 * so an echo that starts arriving during a long transmit is not lost to overrun
+	 * */
+	UART_HandleTypeDef *huart = bluetooth->uart_handler;
+	const uint32_t tickStart = HAL_GetTick();
+
+	// the reception is only claimed when nothing else (IT, DMA, RX stream) owns it, and nothing can finish meanwhile
+	const uint32_t primask = enterCritical();
+	if(huart->RxState != HAL_UART_STATE_READY || bluetooth->rxMode != RX_MODE_NONE)
+	{
+		exitCritical(primask);
+		return BLUETOOTH_FAIL;
+	}
+
+	bluetooth->rxMode = RX_MODE_EXCHANGE;
+	const HAL_StatusTypeDef status = HAL_UART_Receive_IT(huart, rxData, length);
+	if(status != HAL_OK)
+	{
+		bluetooth->rxMode = RX_MODE_NONE;
+	}
+	exitCritical(primask);
+
+	if(status != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	if(transmitBlocking(bluetooth, (uint8_t*)txData, length, timeout) != HAL_OK)
+	{
+		HAL_UART_AbortReceive(huart);
+		bluetooth->rxMode = RX_MODE_NONE;
+		return BLUETOOTH_FAIL;
+	}
+
+	// RX complete clears the mode, an error abort leaves it set with the UART idle
+	while(bluetooth->rxMode == RX_MODE_EXCHANGE && huart->RxState != HAL_UART_STATE_READY)
+	{
+		if(HAL_GetTick() - tickStart >= timeout)
+		{
+			HAL_UART_AbortReceive(huart);
+			break;
+		}
+	}
+
+	if(bluetooth->rxMode == RX_MODE_NONE)
+	{
+		return BLUETOOTH_OK;
+	}
+
+	bluetooth->rxMode = RX_MODE_NONE;
+	return BLUETOOTH_FAIL;
+}
+
+Bluetooth_response bluetooth_readUntil(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, const char* delimiter, uint32_t timeout)
+{
+	assert(bluetooth);
+	assert(message);
+	assert(delimiter);
+	assert(maxMessageLength > 0);
+
+	const uint8_t delimiterLength = strlen(delimiter);
+	assert(delimiterLength > 0 && delimiterLength < BLUETOOTH_LINE_BUFFER_SIZE);
+
+	/* timeout bounds the whole call, not a single byte,
+	 * and only the newly received part of the buffer is scanned each time
+	 * */
+	const uint32_t tickStart = HAL_GetTick();
+	uint16_t scanBegin = 0;
+
+	while(true)
+	{
+		const uint16_t recordLength = findDelimiter(bluetooth->lineBuffer, bluetooth->lineBufferLength, scanBegin, delimiter, delimiterLength);
+
+		if(recordLength < bluetooth->lineBufferLength)
+		{
+			if(recordLength >= maxMessageLength)
+			{
+				// record does not fit, drop it so the next read starts on a record boundary
+				consumeLineBuffer(bluetooth, recordLength + delimiterLength);
+				return BLUETOOTH_FAIL;
+			}
+
+			memcpy(message, bluetooth->lineBuffer, recordLength);
+			message[recordLength] = '\0';
+			consumeLineBuffer(bluetooth, recordLength + delimiterLength);
+
+			return BLUETOOTH_OK;
+		}
+
+		if(bluetooth->lineBufferLength == BLUETOOTH_LINE_BUFFER_SIZE)
+		{
+			/* No delimiter in a full buffer, the record can never be returned.
+			 * Its end may be the first part of a split delimiter, that part is kept
+			 * */
+			uint8_t keep = delimiterLength - 1;
+			while(keep > 0 && memcmp(bluetooth->lineBuffer + BLUETOOTH_LINE_BUFFER_SIZE - keep, delimiter, keep) != 0)
+			{
+				--keep;
+			}
+
+			consumeLineBuffer(bluetooth, BLUETOOTH_LINE_BUFFER_SIZE - keep);
+			return BLUETOOTH_FAIL;
+		}
+
+		// a delimiter may be split between the old and the new data
+		scanBegin = bluetooth->lineBufferLength >= delimiterLength ? bluetooth->lineBufferLength - delimiterLength + 1 : 0;
+
+		const uint32_t elapsed = HAL_GetTick() - tickStart;
+		if(elapsed >= timeout || fillLineBuffer(bluetooth, timeout - elapsed) != HAL_OK)
+		{
+			return BLUETOOTH_FAIL;
+		}
+	}
+}
+
+Bluetooth_response bluetooth_readLine(bluetooth_handler_t *bluetooth, char* message, uint32_t maxMessageLength, uint32_t timeout)
+{
+	return bluetooth_readUntil(bluetooth, message, maxMessageLength, LINE_DELIMITER, timeout);
+}
+
+Bluetooth_response bluetooth_readMessage_IT(bluetooth_handler_t *bluetooth, uint32_t messageLength)
+{
+	assert(bluetooth);
+	assert(messageLength < BLUETOOTH_RECEIVED_DATA_BUFFER);
+
+	bluetooth->receiveBuffer->dataEnd = messageLength;
+
+	if(startReception(bluetooth, RX_MODE_IT, messageLength) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_readMessage_DMA(bluetooth_handler_t *bluetooth, uint32_t messageLength)
+{
+	assert(bluetooth);
+	assert(messageLength < BLUETOOTH_RECEIVED_DATA_BUFFER);
+
+	bluetooth->receiveBuffer->dataEnd = messageLength;
+
+	if(startReception(bluetooth, RX_MODE_DMA, messageLength) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_readMessage_ToIdle(bluetooth_handler_t *bluetooth, uint32_t maxMessageLength)
+{
+	assert(bluetooth);
+	assert(maxMessageLength < BLUETOOTH_RECEIVED_DATA_BUFFER);
+
+	// reception ends on a full buffer or when the line goes idle, whichever comes first
+	bluetooth->receiveBuffer->dataEnd = 0;
+
+	if(startReception(bluetooth, RX_MODE_TO_IDLE, maxMessageLength) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_startRxStream(bluetooth_handler_t *bluetooth, uint8_t *ring, uint16_t ringSize)
+{
+	assert(bluetooth);
+	assert(ring);
+	assert(ringSize > BLUETOOTH_RX_STREAM_CHUNK_SIZE);
+
+	/* Reception never stops: every idle line or full chunk is moved into the ring
+	 * and DMA is re-armed from the callback, so nothing depends on how often the ring is read
+	 * */
+	bluetooth->streamRing = ring;
+	bluetooth->streamRingSize = ringSize;
+	bluetooth->streamHead = 0;
+	bluetooth->streamTail = 0;
+
+	if(startReception(bluetooth, RX_MODE_STREAM, BLUETOOTH_RX_STREAM_CHUNK_SIZE) == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+Bluetooth_response bluetooth_stopRxStream(bluetooth_handler_t *bluetooth)
+{
+	assert(bluetooth);
+
+	/* Blocking receives and the other reception modes get the UART back,
+	 * bytes already moved into the ring can still be read
+	 * */
+	UART_HandleTypeDef *huart = bluetooth->uart_handler;
+	HAL_StatusTypeDef status = HAL_OK;
+
+	// the callback must not re-arm the stream between the mode change and the abort
+	const uint32_t primask = enterCritical();
+	if(bluetooth->rxMode == RX_MODE_STREAM)
+	{
+		bluetooth->rxMode = RX_MODE_NONE;
+		status = HAL_UART_AbortReceive(huart);
+
+		// the part of the chunk received so far is still good data
+		if(huart->hdmarx != NULL)
+		{
+			const uint16_t remaining = __HAL_DMA_GET_COUNTER(huart->hdmarx);
+			if(remaining <= bluetooth->rxLength)
+			{
+				pushStreamData(bluetooth, bluetooth->rxLength - remaining);
+			}
+		}
+	}
+	exitCritical(primask);
+
+	if(status == HAL_OK)
+	{
+		return BLUETOOTH_OK;
+	}
+	else
+	{
+		return BLUETOOTH_FAIL;
+	}
+}
+
+uint16_t bluetooth_readRxStream(bluetooth_handler_t *bluetooth, uint8_t *data, uint16_t maxLength)
+{
+	assert(bluetooth);
+	assert(data);
+
+	uint16_t count = 0;
+	while(count < maxLength && bluetooth->streamTail != bluetooth->streamHead)
+	{
+		data[count++] = bluetooth->streamRing[bluetooth->streamTail];
+		bluetooth->streamTail = (bluetooth->streamTail + 1) % bluetooth->streamRingSize;
+	}
+
+	return count;
+}
+
+Bluetooth_response bluetooth_registerEventHandler(bluetooth_handler_t *bluetooth, Bluetooth_eventType type, bluetooth_eventHandler handler, void *context)
+{
+	assert(bluetooth);
+
+	if(type >= BLUETOOTH_EVENT_COUNT)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	bluetooth->subscriptions[type].handler = handler;
+	bluetooth->subscriptions[type].context = context;
+
+	return BLUETOOTH_OK;
+}
+
+uint32_t bluetooth_processEvents(bluetooth_handler_t *bluetooth)
+{
+	assert(bluetooth);
+
+	// handlers run here, in thread context, so they may block or take as long as they need
+	restartTxQueue(bluetooth);
+
+	uint32_t processed = 0;
+	while(bluetooth->eventTail != bluetooth->eventHead)
+	{
+		const bluetooth_event event = bluetooth->eventQueue[bluetooth->eventTail];
+		bluetooth->eventTail = (bluetooth->eventTail + 1) % BLUETOOTH_EVENT_QUEUE_SIZE;
+
+		const bluetooth_eventSubscription *subscription = &bluetooth->subscriptions[event.type];
+		if(subscription->handler != NULL)
+		{
+			subscription->handler(bluetooth, &event, subscription->context);
+		}
+
+		++processed;
+	}
+
+	return processed;
+}
+
+void bluetooth_notifyLinkState(bluetooth_handler_t *bluetooth, bool connected)
+{
+	assert(bluetooth);
+
+	// meant to be called from the EXTI callback of the module STATE pin
+	const uint32_t cycleStart = DWT->CYCCNT;
+	postEvent(bluetooth, connected ? BLUETOOTH_EVENT_LINK_UP : BLUETOOTH_EVENT_LINK_DOWN, NULL, 0, 0);
+	updateIsrCycles(bluetooth, cycleStart);
+}
+
+void bluetooth_getEventStats(bluetooth_handler_t *bluetooth, bluetooth_eventStats *stats)
+{
+	assert(bluetooth);
+	assert(stats);
+
+	stats->queuedEvents = bluetooth->eventStats.queuedEvents;
+	stats->droppedEvents = bluetooth->eventStats.droppedEvents;
+	stats->maxQueueDepth = bluetooth->eventStats.maxQueueDepth;
+	stats->maxIsrCycles = bluetooth->eventStats.maxIsrCycles;
+}
+
+void bluetooth_getUartErrorStats(bluetooth_handler_t *bluetooth, bluetooth_uartErrorStats *stats)
+{
+	assert(bluetooth);
+	assert(stats);
+
+	const uint32_t primask = enterCritical();
+	stats->overrunErrors = bluetooth->uartErrorStats.overrunErrors;
+	stats->framingErrors = bluetooth->uartErrorStats.framingErrors;
+	stats->noiseErrors = bluetooth->uartErrorStats.noiseErrors;
+	stats->parityErrors = bluetooth->uartErrorStats.parityErrors;
+	stats->dmaErrors = bluetooth->uartErrorStats.dmaErrors;
+	stats->recoveries = bluetooth->uartErrorStats.recoveries;
+	stats->failedRecoveries = bluetooth->uartErrorStats.failedRecoveries;
+	stats->lostBytes = bluetooth->uartErrorStats.lostBytes;
+	stats->maxRecoveryCycles = bluetooth->uartErrorStats.maxRecoveryCycles;
+	exitCritical(primask);
+}
+
+void bluetooth_onRxComplete(UART_HandleTypeDef *huart)
+{
+	bluetooth_handler_t *bluetooth = findInstance(huart);
+	if(bluetooth == NULL)
+	{
+		return;
+	}
+
+	const uint32_t cycleStart = DWT->CYCCNT;
+
+	if(bluetooth->rxMode == RX_MODE_EXCHANGE)
+	{
+		bluetooth->rxMode = RX_MODE_NONE;
+		updateIsrCycles(bluetooth, cycleStart);
+		return;
+	}
+
+	bluetooth->rxMode = RX_MODE_NONE;
+
+	bluetooth_receivedDataBuffer *receiveBuffer = bluetooth->receiveBuffer;
+	const uint16_t length = receiveBuffer->dataEnd;
+	if(length >= BLUETOOTH_RECEIVED_DATA_BUFFER)
+	{
+		// not a reception started by bluetooth_readMessage_xxx, there is no room for its terminator
+		updateIsrCycles(bluetooth, cycleStart);
+		return;
+	}
+	receiveBuffer->receivedData[length] = '\0';
+	receiveBuffer->isDataReady = true;
+
+	postEvent(bluetooth, classifyReceivedData(bluetooth, length), (const uint8_t*)receiveBuffer->receivedData, length, 0);
+	updateIsrCycles(bluetooth, cycleStart);
+}
+
+void bluetooth_onTxComplete(UART_HandleTypeDef *huart)
+{
+	bluetooth_handler_t *bluetooth = findInstance(huart);
+	if(bluetooth == NULL)
+	{
+		return;
+	}
+
+	const uint32_t cycleStart = DWT->CYCCNT;
+
+	if(bluetooth->txInFlight)
+	{
+		const uint8_t *messageData;
+		uint16_t messageLength;
+		if(finishTransfer(bluetooth, &messageData, &messageLength))
+		{
+			postEvent(bluetooth, BLUETOOTH_EVENT_TX_DONE, messageData, messageLength, 0);
+		}
+	}
+	else
+	{
+		// a transfer the application started directly through the HAL
+		postEvent(bluetooth, BLUETOOTH_EVENT_TX_DONE, NULL, 0, 0);
+	}
+	startNextTransfer(bluetooth);
+
+	updateIsrCycles(bluetooth, cycleStart);
+}
+
+void bluetooth_onRxIdle(UART_HandleTypeDef *huart, uint16_t size)
+{
+	/* The idle line or a full buffer closes a reception started with bluetooth_readMessage_ToIdle.
+	 * The half-transfer event arrives while DMA still fills the buffer, so it is ignored
+	 * */
+	if(huart->RxState != HAL_UART_STATE_READY)
+	{
+		return;
+	}
+
+	bluetooth_handler_t *bluetooth = findInstance(huart);
+	if(bluetooth == NULL)
+	{
+		return;
+	}
+
+	if(bluetooth->rxMode == RX_MODE_STREAM)
+	{
+		const uint32_t cycleStart = DWT->CYCCNT;
+
+		pushStreamData(bluetooth, size);
+		if(startReception(bluetooth, RX_MODE_STREAM, BLUETOOTH_RX_STREAM_CHUNK_SIZE) != HAL_OK)
+		{
+			bluetooth->rxMode = RX_MODE_NONE;
+		}
+
+		updateIsrCycles(bluetooth, cycleStart);
+		return;
+	}
+
+	// bluetooth_readMessage_ToIdle never asks for more than the receive buffer holds
+	if(size >= BLUETOOTH_RECEIVED_DATA_BUFFER)
+	{
+		return;
+	}
+
+	bluetooth->receiveBuffer->dataEnd = size;
+	bluetooth_onRxComplete(huart);
+}
+
+void bluetooth_onError(UART_HandleTypeDef *huart)
+{
+	bluetooth_handler_t *bluetooth = findInstance(huart);
+	if(bluetooth == NULL)
+	{
+		return;
+	}
+
+	const uint32_t cycleStart = DWT->CYCCNT;
+	const uint32_t errorCode = huart->ErrorCode;
+
+	countUartErrors(bluetooth, errorCode);
+
+	/* With DMA nobody reads DR on the CPU side, so the flags are cleared here with an SR then DR read.
+	 * Blocking and IT receptions read DR themselves, clearing here would lose their next byte
+	 * */
+	const uint8_t rxMode = bluetooth->rxMode;
+	if(rxMode == RX_MODE_DMA || rxMode == RX_MODE_TO_IDLE || rxMode == RX_MODE_STREAM)
+	{
+		__HAL_UART_CLEAR_PEFLAG(huart);
+	}
+
+	recoverReception(bluetooth, cycleStart);
+	recoverTransmission(bluetooth);
+
+	postEvent(bluetooth, BLUETOOTH_EVENT_ERROR, NULL, 0, errorCode);
+	updateIsrCycles(bluetooth, cycleStart);
+}
+
+#if BLUETOOTH_OWN_HAL_CALLBACKS
+/** HAL Callbacks ------------------------------------------------------------*/
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	bluetooth_onRxComplete(huart);
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	bluetooth_onTxComplete(huart);
+}
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	bluetooth_onRxIdle(huart, Size);
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	bluetooth_onError(huart);
+}
+#endif
 
 Bluetooth_response bluetooth_getName(bluetooth_handler_t *bluetooth, char* name)
 {
@@ -572,12 +1848,13 @@ Bluetooth_response bluetooth_getName(bluetooth_handler_t *bluetooth, char* name)
 	assert(name);
 
 	char* getModuleName = "AT+NAME\r\n";
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)getModuleName, strlen(getModuleName), TIMEOUT);
+	transmitBlocking(bluetooth, (uint8_t*)getModuleName, strlen(getModuleName), TIMEOUT);
 
 	char response[GET_NAME_RESPONSE_SIZE + 1];
 	uint8_t responseIndex = -1;
 	char ch;
-	while(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)&ch, 1, TIMEOUT) != HAL_TIMEOUT)
+	HAL_StatusTypeDef status;
+	while((status = HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)&ch, 1, TIMEOUT)) == HAL_OK)
 	{
 		response[++responseIndex] = ch;
 		if(responseIndex == GET_NAME_RESPONSE_SIZE)
@@ -587,6 +1864,12 @@ Bluetooth_response bluetooth_getName(bluetooth_handler_t *bluetooth, char* name)
 	}
 	response[responseIndex + 1] = '\0';
 
+	// the answer ends with a timeout, HAL_BUSY means another reception owns the UART
+	if(status != HAL_TIMEOUT)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
 	if(isGetNameResponseCorrect(response))
 	{
 		getModuleNameFromResponse(response, name);
@@ -606,13 +1889,16 @@ Bluetooth_response bluetooth_setName(bluetooth_handler_t *bluetooth, char* name)
 	char setNameCommand[GET_NAME_RESPONSE_SIZE + 1];
 	uint8_t writtenChars = sprintf(setNameCommand, "AT+NAME=\"%s\"\r\n", name);
 
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)setNameCommand, writtenChars, TIMEOUT) != HAL_OK)
+	if(transmitBlocking(bluetooth, (uint8_t*)setNameCommand, writtenChars, TIMEOUT) != HAL_OK)
 	{
 		return BLUETOOTH_FAIL;
 	}
 
 	char setNameResponse[OK_RESPONSE_SIZE + 1];
-	HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)setNameResponse, OK_RESPONSE_SIZE, TIMEOUT);
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)setNameResponse, OK_RESPONSE_SIZE, TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
 	setNameResponse[OK_RESPONSE_SIZE] = '\0';
 
 	if(strcmp(setNameResponse, OK_RESPONSE) != 0)
@@ -631,7 +1917,7 @@ Bluetooth_response bluetooth_getPassword(bluetooth_handler_t *bluetooth, char* p
 	assert(password);
 
 	char* getPasswordCommand = "AT+PSWD\r\n";
-	HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)getPasswordCommand, strlen(getPasswordCommand), TIMEOUT);
+	transmitBlocking(bluetooth, (uint8_t*)getPasswordCommand, strlen(getPasswordCommand), TIMEOUT);
 
 	char response[GET_PASSWORD_COMMAND_RESPONSE_LENGTH + 1];
 	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)response, GET_PASSWORD_COMMAND_RESPONSE_LENGTH, TIMEOUT) != HAL_OK)
@@ -660,7 +1946,7 @@ Bluetooth_response bluetooth_setPassword(bluetooth_handler_t *bluetooth, char* p
 
 	int writtenChars = sprintf(setPasswordCommand, "AT+PSWD=\"%s\"\r\n", password);
 
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)setPasswordCommand, writtenChars, TIMEOUT) != HAL_OK)
+	if(transmitBlocking(bluetooth, (uint8_t*)setPasswordCommand, writtenChars, TIMEOUT) != HAL_OK)
 	{
 		return BLUETOOTH_FAIL;
 	}
@@ -670,6 +1956,7 @@ Bluetooth_response bluetooth_setPassword(bluetooth_handler_t *bluetooth, char* p
 	{
 		return BLUETOOTH_FAIL;
 	}
+	bluetoothResponse[OK_RESPONSE_SIZE] = '\0';
 
 	if(strcmp(bluetoothResponse, OK_RESPONSE) != 0)
 	{
@@ -685,7 +1972,7 @@ Bluetooth_response bluetooth_getModuleAddress(bluetooth_handler_t *bluetooth, ch
 {
 	char* bluetoothModuleAddressCommand = "AT+ADDR?\r\n";
 
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)bluetoothModuleAddressCommand, strlen(bluetoothModuleAddressCommand), TIMEOUT) != HAL_OK)
+	if(transmitBlocking(bluetooth, (uint8_t*)bluetoothModuleAddressCommand, strlen(bluetoothModuleAddressCommand), TIMEOUT) != HAL_OK)
 	{
 		return BLUETOOTH_FAIL;
 	}
@@ -713,7 +2000,7 @@ Bluetooth_response bluetooth_getModuleRole(bluetooth_handler_t *bluetooth, Bluet
 {
 	char* moduleRoleCommand = "AT+ROLE\r\n";
 
-	if(HAL_UART_Transmit(bluetooth->uart_handler, (uint8_t*)moduleRoleCommand, strlen(moduleRoleCommand), TIMEOUT + 1000) != HAL_OK)
+	if(transmitBlocking(bluetooth, (uint8_t*)moduleRoleCommand, strlen(moduleRoleCommand), TIMEOUT + 1000) != HAL_OK)
 	{
 		return BLUETOOTH_FAIL;
 	}
@@ -736,3 +2023,36 @@ Bluetooth_response bluetooth_getModuleRole(bluetooth_handler_t *bluetooth, Bluet
 		return BLUETOOTH_FAIL;
 	}
 }
+
+Bluetooth_response bluetooth_setModuleRole(bluetooth_handler_t *bluetooth, Bluetooth_moduleRole moduleRole)
+{
+	assert(bluetooth);
+	assert(moduleRole == BLUETOOTH_SLAVE_ROLE || moduleRole == BLUETOOTH_MASTER_ROLE || moduleRole == BLUETOOTH_SLAVE_LOOP_ROLE);
+
+	/*Command format is: AT+ROLE=<Param>\r\n
+	 * where enum values match the module parameter: 0 - slave, 1 - master, 2 - slave-loop
+	 * */
+	char moduleRoleCommand[SET_MODULE_ROLE_COMMAND_LENGTH + 1];
+	uint8_t writtenChars = sprintf(moduleRoleCommand, "AT+ROLE=%u\r\n", (unsigned)moduleRole);
+
+	if(transmitBlocking(bluetooth, (uint8_t*)moduleRoleCommand, writtenChars, TIMEOUT) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	char moduleRoleResponse[OK_RESPONSE_SIZE + 1];
+	if(HAL_UART_Receive(bluetooth->uart_handler, (uint8_t*)moduleRoleResponse, OK_RESPONSE_SIZE, TIMEOUT + 1000) != HAL_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	moduleRoleResponse[OK_RESPONSE_SIZE] = '\0';
+
+	if(strcmp(moduleRoleResponse, OK_RESPONSE) != 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+	else
+	{
+		return BLUETOOTH_OK;
+	}
+}
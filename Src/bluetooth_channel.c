@@ -0,0 +1,466 @@
+/* Includes ------------------------------------------------------------------*/
+#include "bluetooth_channel.h"
+
+#include <string.h>
+#include <assert.h>
+
+#define FRAME_START 0xA5
+#define FRAME_HEADER_SIZE 3
+#define FRAME_COUNTER_SIZE 2
+#define CREDIT_FLAG 0x80
+#define SYNC_FLAG 0x40
+#define CHANNEL_ID_MASK 0x3F
+#define CREDIT_GRANT_THRESHOLD (BLUETOOTH_CHANNEL_MAX_PAYLOAD / 2)
+#define RX_BYTES_PER_POLL 256
+#define RX_READ_CHUNK 32
+#define COUNTER_BEHIND 0x8000U
+
+enum Bluetooth_channelRxState
+{
+	RX_WAIT_START,
+	RX_CHANNEL,
+	RX_LENGTH,
+	RX_PAYLOAD,
+	RX_CHECKSUM
+};
+
+/** Static Functions -------------------------------------------------------- */
+static Bluetooth_response sendFrame(bluetooth_channelMux *mux, uint8_t channelId, uint16_t counter, const uint8_t *data, uint8_t length, uint32_t timeout)
+{
+	// every frame starts its payload with a 2-byte counter: stream offset, consumed or sent total
+	uint8_t *frame = mux->txFrame;
+	const uint8_t payloadLength = FRAME_COUNTER_SIZE + length;
+
+	frame[0] = FRAME_START;
+	frame[1] = channelId;
+	frame[2] = payloadLength;
+	frame[FRAME_HEADER_SIZE] = counter & 0xFF;
+	frame[FRAME_HEADER_SIZE + 1] = counter >> 8;
+	for(uint8_t i = 0; i < length; ++i)
+	{
+		frame[FRAME_HEADER_SIZE + FRAME_COUNTER_SIZE + i] = data[i];
+	}
+
+	uint8_t checksum = channelId ^ payloadLength;
+	for(uint8_t i = 0; i < payloadLength; ++i)
+	{
+		checksum ^= frame[FRAME_HEADER_SIZE + i];
+	}
+	frame[FRAME_HEADER_SIZE + payloadLength] = checksum;
+
+	return bluetooth_sendData(mux->bluetooth, frame, FRAME_HEADER_SIZE + payloadLength + 1, timeout);
+}
+
+static uint16_t availableCredits(const bluetooth_channel *channel)
+{
+	const uint16_t inFlight = channel->txTotal - channel->peerConsumed;
+	return inFlight < BLUETOOTH_CHANNEL_RX_BUFFER_SIZE ? BLUETOOTH_CHANNEL_RX_BUFFER_SIZE - inFlight : 0;
+}
+
+static Bluetooth_response sendCreditGrants(bluetooth_channelMux *mux, uint32_t timeout)
+{
+	/* Credits go back once a part of the buffer is free, once the application emptied it,
+	 * or when the peer asked for them with a sync, so it is never left waiting on a few missing bytes
+	 * */
+	for(uint8_t id = 0; id < BLUETOOTH_CHANNEL_COUNT; ++id)
+	{
+		bluetooth_channel *channel = &mux->channels[id];
+		const uint16_t consumed = channel->rxTotal - channel->rxCount;
+		const uint16_t pending = consumed - channel->grantedTotal;
+
+		if(!channel->grantRequested)
+		{
+			if(pending == 0)
+			{
+				continue;
+			}
+
+			if(pending < CREDIT_GRANT_THRESHOLD && channel->rxCount != 0)
+			{
+				continue;
+			}
+		}
+
+		if(sendFrame(mux, CREDIT_FLAG | id, consumed, NULL, 0, timeout) != BLUETOOTH_OK)
+		{
+			return BLUETOOTH_FAIL;
+		}
+		channel->grantedTotal = consumed;
+		channel->grantRequested = false;
+	}
+
+	return BLUETOOTH_OK;
+}
+
+static Bluetooth_response sendSyncIfStalled(bluetooth_channelMux *mux, uint8_t id, uint32_t timeout)
+{
+	// a lost grant or data frame would otherwise keep the credits away for good
+	bluetooth_channel *channel = &mux->channels[id];
+	const uint32_t now = HAL_GetTick();
+
+	if(!channel->stalled)
+	{
+		channel->stalled = true;
+		channel->stallTick = now;
+		return BLUETOOTH_OK;
+	}
+
+	if(now - channel->stallTick < BLUETOOTH_CHANNEL_SYNC_TIMEOUT)
+	{
+		return BLUETOOTH_OK;
+	}
+
+	channel->stallTick = now;
+	++channel->stats.resyncs;
+
+	return sendFrame(mux, SYNC_FLAG | id, channel->txTotal, NULL, 0, timeout);
+}
+
+static Bluetooth_response sendRound(bluetooth_channelMux *mux, uint32_t timeout)
+{
+	/* Deficit round-robin: every backlogged channel earns its quantum per round
+	 * and sends frames while the head frame fits into the deficit,
+	 * so each channel gets bandwidth proportional to its quantum whatever its frame sizes
+	 * */
+	for(uint8_t visited = 0; visited < BLUETOOTH_CHANNEL_COUNT; ++visited)
+	{
+		const uint8_t id = mux->currentChannel;
+		bluetooth_channel *channel = &mux->channels[id];
+		mux->currentChannel = (id + 1) % BLUETOOTH_CHANNEL_COUNT;
+
+		if(channel->txCount == 0)
+		{
+			channel->deficit = 0;
+			continue;
+		}
+
+		// a credit-stalled channel must not build up a burst
+		channel->deficit += channel->quantum;
+		if(channel->deficit > channel->quantum + BLUETOOTH_CHANNEL_MAX_PAYLOAD)
+		{
+			channel->deficit = channel->quantum + BLUETOOTH_CHANNEL_MAX_PAYLOAD;
+		}
+
+		while(channel->txCount > 0)
+		{
+			bluetooth_channelMessage *message = &channel->txQueue[channel->txHead];
+
+			uint16_t frameLength = message->length - message->offset;
+			if(frameLength > BLUETOOTH_CHANNEL_MAX_PAYLOAD)
+			{
+				frameLength = BLUETOOTH_CHANNEL_MAX_PAYLOAD;
+			}
+
+			if(frameLength > channel->deficit)
+			{
+				break;
+			}
+
+			if(frameLength > availableCredits(channel))
+			{
+				++channel->stats.creditStalls;
+				if(sendSyncIfStalled(mux, id, timeout) != BLUETOOTH_OK)
+				{
+					return BLUETOOTH_FAIL;
+				}
+				break;
+			}
+			channel->stalled = false;
+
+			if(sendFrame(mux, id, channel->txTotal, message->data + message->offset, frameLength, timeout) != BLUETOOTH_OK)
+			{
+				return BLUETOOTH_FAIL;
+			}
+
+			channel->deficit -= frameLength;
+			channel->txTotal += frameLength;
+			message->offset += frameLength;
+			channel->stats.bytesSent += frameLength;
+			++channel->stats.framesSent;
+
+			if(message->offset == message->length)
+			{
+				const uint32_t latency = bluetooth_cyclesToMicroseconds(DWT->CYCCNT - message->enqueueCycles);
+				if(latency > channel->stats.maxLatencyUs)
+				{
+					channel->stats.maxLatencyUs = latency;
+				}
+
+				channel->txHead = (channel->txHead + 1) % BLUETOOTH_CHANNEL_TX_QUEUE_SIZE;
+				--channel->txCount;
+			}
+		}
+
+		if(channel->txCount == 0)
+		{
+			channel->deficit = 0;
+		}
+	}
+
+	return BLUETOOTH_OK;
+}
+
+static void skipLostBytes(bluetooth_channel *channel, uint16_t streamOffset)
+{
+	/* The peer never sends more than the buffer size ahead of what was granted,
+	 * so a larger jump is a corrupted counter rather than lost data
+	 * */
+	const uint16_t gap = streamOffset - channel->rxTotal;
+	if(gap == 0 || gap >= COUNTER_BEHIND || gap > BLUETOOTH_CHANNEL_RX_BUFFER_SIZE)
+	{
+		return;
+	}
+
+	channel->stats.rxLostBytes += gap;
+	channel->rxTotal = streamOffset;
+}
+
+static void deliverFrame(bluetooth_channelMux *mux)
+{
+	const uint8_t id = mux->rxChannel & CHANNEL_ID_MASK;
+	if(id >= BLUETOOTH_CHANNEL_COUNT || mux->rxLength < FRAME_COUNTER_SIZE)
+	{
+		++mux->rxBadFrames;
+		return;
+	}
+
+	bluetooth_channel *channel = &mux->channels[id];
+	const uint16_t counter = mux->rxPayload[0] | (mux->rxPayload[1] << 8);
+
+	if(mux->rxChannel & CREDIT_FLAG)
+	{
+		// grants are cumulative, an old or duplicated one is simply ignored
+		const uint16_t advance = counter - channel->peerConsumed;
+		const uint16_t inFlight = channel->txTotal - channel->peerConsumed;
+		if(advance <= inFlight)
+		{
+			channel->peerConsumed = counter;
+			channel->stalled = false;
+		}
+		return;
+	}
+
+	if(mux->rxChannel & SYNC_FLAG)
+	{
+		// whatever the peer sent up to its total and did not arrive is written off
+		skipLostBytes(channel, counter);
+		channel->grantRequested = true;
+		return;
+	}
+
+	const uint8_t dataLength = mux->rxLength - FRAME_COUNTER_SIZE;
+	const uint16_t ahead = counter - channel->rxTotal;
+	if(ahead >= COUNTER_BEHIND || ahead + dataLength > BLUETOOTH_CHANNEL_RX_BUFFER_SIZE)
+	{
+		// duplicate or corrupted offset
+		++mux->rxBadFrames;
+		return;
+	}
+	skipLostBytes(channel, counter);
+
+	// still accounted for, so the peer gets the credit back even though the data is dropped
+	channel->rxTotal += dataLength;
+
+	if(channel->rxCount + dataLength > BLUETOOTH_CHANNEL_RX_BUFFER_SIZE)
+	{
+		++channel->stats.rxOverflows;
+		channel->stats.rxLostBytes += dataLength;
+		return;
+	}
+
+	for(uint8_t i = 0; i < dataLength; ++i)
+	{
+		const uint16_t tail = (channel->rxHead + channel->rxCount) % BLUETOOTH_CHANNEL_RX_BUFFER_SIZE;
+		channel->rxBuffer[tail] = mux->rxPayload[FRAME_COUNTER_SIZE + i];
+		++channel->rxCount;
+	}
+	channel->stats.bytesReceived += dataLength;
+}
+
+/** Functions ----------------------------------------------------------------*/
+Bluetooth_response bluetooth_channelInit(bluetooth_channelMux *mux, bluetooth_handler_t *bluetooth)
+{
+	assert(mux);
+	assert(bluetooth);
+
+	memset(mux, 0, sizeof(bluetooth_channelMux));
+	mux->bluetooth = bluetooth;
+	mux->rxState = RX_WAIT_START;
+	bluetooth_enableCycleCounter();
+
+	// both ends start with all counters at zero and the same buffer sizes, so each knows the credits of the other
+	for(uint8_t id = 0; id < BLUETOOTH_CHANNEL_COUNT; ++id)
+	{
+		mux->channels[id].quantum = BLUETOOTH_CHANNEL_DEFAULT_QUANTUM;
+	}
+
+	// received bytes land in the ring from the UART callbacks, not while a frame is being sent
+	return bluetooth_startRxStream(bluetooth, mux->rxRing, BLUETOOTH_CHANNEL_RX_RING_SIZE);
+}
+
+Bluetooth_response bluetooth_channelDeinit(bluetooth_channelMux *mux)
+{
+	assert(mux);
+
+	// the UART goes back to blocking AT commands, queued messages and unread data are dropped
+	return bluetooth_stopRxStream(mux->bluetooth);
+}
+
+Bluetooth_response bluetooth_channelSetQuantum(bluetooth_channelMux *mux, uint8_t channel, uint16_t quantum)
+{
+	assert(mux);
+
+	if(channel >= BLUETOOTH_CHANNEL_COUNT || quantum == 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	mux->channels[channel].quantum = quantum;
+	return BLUETOOTH_OK;
+}
+
+Bluetooth_response bluetooth_channelSend(bluetooth_channelMux *mux, uint8_t channel, const uint8_t *data, uint16_t length)
+{
+	assert(mux);
+	assert(data);
+	assert(length > 0);
+
+	// data is framed straight from the caller buffer, which must stay valid until it is sent
+	if(channel >= BLUETOOTH_CHANNEL_COUNT)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	bluetooth_channel *ch = &mux->channels[channel];
+	if(ch->txCount == BLUETOOTH_CHANNEL_TX_QUEUE_SIZE)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	bluetooth_channelMessage *message = &ch->txQueue[(ch->txHead + ch->txCount) % BLUETOOTH_CHANNEL_TX_QUEUE_SIZE];
+	message->data = data;
+	message->length = length;
+	message->offset = 0;
+	message->enqueueCycles = DWT->CYCCNT;
+	++ch->txCount;
+
+	return BLUETOOTH_OK;
+}
+
+uint16_t bluetooth_channelRead(bluetooth_channelMux *mux, uint8_t channel, uint8_t *data, uint16_t maxLength)
+{
+	assert(mux);
+	assert(data);
+
+	if(channel >= BLUETOOTH_CHANNEL_COUNT)
+	{
+		return 0;
+	}
+
+	bluetooth_channel *ch = &mux->channels[channel];
+	uint16_t count = 0;
+	while(count < maxLength && ch->rxCount > 0)
+	{
+		data[count++] = ch->rxBuffer[ch->rxHead];
+		ch->rxHead = (ch->rxHead + 1) % BLUETOOTH_CHANNEL_RX_BUFFER_SIZE;
+		--ch->rxCount;
+	}
+
+	return count;
+}
+
+void bluetooth_channelFeed(bluetooth_channelMux *mux, const uint8_t *data, uint16_t length)
+{
+	assert(mux);
+	assert(data);
+
+	for(uint16_t i = 0; i < length; ++i)
+	{
+		const uint8_t byte = data[i];
+
+		switch(mux->rxState)
+		{
+		case RX_WAIT_START:
+			if(byte == FRAME_START)
+			{
+				mux->rxState = RX_CHANNEL;
+			}
+			break;
+		case RX_CHANNEL:
+			mux->rxChannel = byte;
+			mux->rxChecksum = byte;
+			mux->rxState = RX_LENGTH;
+			break;
+		case RX_LENGTH:
+			if(byte < FRAME_COUNTER_SIZE || byte > BLUETOOTH_CHANNEL_MAX_PAYLOAD + FRAME_COUNTER_SIZE)
+			{
+				++mux->rxBadFrames;
+				mux->rxState = RX_WAIT_START;
+				break;
+			}
+			mux->rxLength = byte;
+			mux->rxIndex = 0;
+			mux->rxChecksum ^= byte;
+			mux->rxState = RX_PAYLOAD;
+			break;
+		case RX_PAYLOAD:
+			mux->rxPayload[mux->rxIndex++] = byte;
+			mux->rxChecksum ^= byte;
+			if(mux->rxIndex == mux->rxLength)
+			{
+				mux->rxState = RX_CHECKSUM;
+			}
+			break;
+		case RX_CHECKSUM:
+			if(byte == mux->rxChecksum)
+			{
+				deliverFrame(mux);
+			}
+			else
+			{
+				++mux->rxBadFrames;
+			}
+			mux->rxState = RX_WAIT_START;
+			break;
+		default:
+			mux->rxState = RX_WAIT_START;
+			break;
+		}
+	}
+}
+
+Bluetooth_response bluetooth_channelPoll(bluetooth_channelMux *mux, uint32_t timeout)
+{
+	assert(mux);
+
+	// take what the RX stream collected so far, bounded so a busy RX cannot starve TX
+	uint8_t chunk[RX_READ_CHUNK];
+	uint16_t received = 0;
+	while(received < RX_BYTES_PER_POLL)
+	{
+		const uint16_t length = bluetooth_readRxStream(mux->bluetooth, chunk, sizeof(chunk));
+		if(length == 0)
+		{
+			break;
+		}
+
+		bluetooth_channelFeed(mux, chunk, length);
+		received += length;
+	}
+
+	if(sendCreditGrants(mux, timeout) != BLUETOOTH_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	return sendRound(mux, timeout);
+}
+
+void bluetooth_channelGetStats(bluetooth_channelMux *mux, uint8_t channel, bluetooth_channelStats *stats)
+{
+	assert(mux);
+	assert(stats);
+	assert(channel < BLUETOOTH_CHANNEL_COUNT);
+
+	*stats = mux->channels[channel].stats;
+}
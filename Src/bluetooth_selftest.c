@@ -0,0 +1,228 @@
+/* Includes ------------------------------------------------------------------*/
+#include "bluetooth_selftest.h"
+
+#include <string.h>
+#include <assert.h>
+
+#define LOST_PACKET_DRAIN_TIMEOUT 10
+
+static uint8_t txPattern[BLUETOOTH_SELFTEST_MAX_PACKET_SIZE];
+static uint8_t rxPattern[BLUETOOTH_SELFTEST_MAX_PACKET_SIZE];
+static uint32_t latenciesUs[BLUETOOTH_SELFTEST_MAX_PACKET_COUNT];
+static uint8_t pipelinePackets[BLUETOOTH_SELFTEST_PIPELINE_DEPTH][BLUETOOTH_SELFTEST_MAX_PACKET_SIZE];
+static uint8_t streamRing[BLUETOOTH_SELFTEST_STREAM_RING_SIZE];
+
+/** Static Functions -------------------------------------------------------- */
+static uint32_t nextRandom(uint32_t *state)
+{
+	// xorshift32, the state must never be zero
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+static void fillPattern(uint8_t *pattern, uint16_t length, uint32_t *state)
+{
+	for(uint16_t i = 0; i < length; ++i)
+	{
+		pattern[i] = (uint8_t)nextRandom(state);
+	}
+}
+
+static uint8_t countBits(uint8_t byte)
+{
+	uint8_t bits = 0;
+	while(byte)
+	{
+		byte &= byte - 1;
+		++bits;
+	}
+
+	return bits;
+}
+
+static void sortLatencies(uint32_t *latencies, uint16_t count)
+{
+	for(uint16_t i = 1; i < count; ++i)
+	{
+		const uint32_t value = latencies[i];
+		int16_t j = i - 1;
+		while(j >= 0 && latencies[j] > value)
+		{
+			latencies[j + 1] = latencies[j];
+			--j;
+		}
+		latencies[j + 1] = value;
+	}
+}
+
+static uint32_t percentile(const uint32_t *sortedLatencies, uint16_t count, uint8_t percent)
+{
+	// nearest-rank method
+	uint16_t rank = (count * percent + 99) / 100;
+	if(rank == 0)
+	{
+		rank = 1;
+	}
+
+	return sortedLatencies[rank - 1];
+}
+
+static void drainLink(bluetooth_handler_t *bluetooth)
+{
+	// a late echo of a lost packet would otherwise be compared against the next one
+	uint8_t ch;
+	while(bluetooth_readData(bluetooth, &ch, 1, LOST_PACKET_DRAIN_TIMEOUT) == BLUETOOTH_OK);
+}
+
+static Bluetooth_response runPipelinedPhase(bluetooth_handler_t *bluetooth, const bluetooth_selfTestConfig *config, bluetooth_selfTestResult *result)
+{
+	/* Packets go out back-to-back through the BULK queue with up to PIPELINE_DEPTH of them in flight,
+	 * the echo is collected by the RX stream and checked against a second copy of the pattern generator
+	 * */
+	const uint32_t seed = config->seed != 0 ? config->seed : 1;
+	uint32_t txRandomState = seed;
+	uint32_t rxRandomState = seed;
+	const uint32_t totalBytes = (uint32_t)config->packetCount * config->packetSize;
+	uint16_t queuedPackets = 0;
+	uint32_t echoedBytes = 0;
+
+	bluetooth_txStats txStats;
+	bluetooth_getTxStats(bluetooth, BLUETOOTH_TX_PRIORITY_BULK, &txStats);
+	const uint32_t sentBefore = txStats.sentMessages;
+
+	if(bluetooth_startRxStream(bluetooth, streamRing, BLUETOOTH_SELFTEST_STREAM_RING_SIZE) != BLUETOOTH_OK)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	const uint32_t cycleStart = DWT->CYCCNT;
+	uint32_t lastEchoTick = HAL_GetTick();
+
+	while(echoedBytes < totalBytes)
+	{
+		// a packet buffer is reused only after its TX_DONE, that is once the queue counted it as sent
+		bluetooth_getTxStats(bluetooth, BLUETOOTH_TX_PRIORITY_BULK, &txStats);
+		const uint32_t sentPackets = txStats.sentMessages - sentBefore;
+		if(queuedPackets < config->packetCount && queuedPackets - sentPackets < BLUETOOTH_SELFTEST_PIPELINE_DEPTH)
+		{
+			uint8_t *packet = pipelinePackets[queuedPackets % BLUETOOTH_SELFTEST_PIPELINE_DEPTH];
+			uint32_t nextRandomState = txRandomState;
+			fillPattern(packet, config->packetSize, &nextRandomState);
+
+			if(bluetooth_queueMessage(bluetooth, packet, config->packetSize, BLUETOOTH_TX_PRIORITY_BULK) == BLUETOOTH_OK)
+			{
+				txRandomState = nextRandomState;
+				++queuedPackets;
+			}
+		}
+
+		uint8_t echo[BLUETOOTH_RX_STREAM_CHUNK_SIZE];
+		const uint16_t count = bluetooth_readRxStream(bluetooth, echo, sizeof(echo));
+		for(uint16_t i = 0; i < count && echoedBytes < totalBytes; ++i, ++echoedBytes)
+		{
+			const uint8_t difference = echo[i] ^ (uint8_t)nextRandom(&rxRandomState);
+			if(difference)
+			{
+				++result->pipelinedByteErrors;
+			}
+		}
+
+		if(count > 0)
+		{
+			lastEchoTick = HAL_GetTick();
+		}
+		else if(HAL_GetTick() - lastEchoTick >= config->timeout)
+		{
+			break;
+		}
+	}
+
+	const uint32_t microseconds = bluetooth_cyclesToMicroseconds(DWT->CYCCNT - cycleStart);
+	bluetooth_stopRxStream(bluetooth);
+
+	result->pipelinedBytesCompared = echoedBytes;
+	result->pipelinedBytesMissing = totalBytes - echoedBytes;
+	if(microseconds > 0)
+	{
+		result->pipelinedBytesPerSecond = (uint32_t)((uint64_t)echoedBytes * 1000000U / microseconds);
+	}
+
+	if(echoedBytes == 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	return BLUETOOTH_OK;
+}
+
+/** Functions ----------------------------------------------------------------*/
+Bluetooth_response bluetooth_runSelfTest(bluetooth_handler_t *bluetooth, const bluetooth_selfTestConfig *config, bluetooth_selfTestResult *result)
+{
+	assert(bluetooth);
+	assert(config);
+	assert(result);
+	assert(config->packetSize > 0 && config->packetSize <= BLUETOOTH_SELFTEST_MAX_PACKET_SIZE);
+	assert(config->packetCount > 0 && config->packetCount <= BLUETOOTH_SELFTEST_MAX_PACKET_COUNT);
+
+	memset(result, 0, sizeof(bluetooth_selfTestResult));
+	bluetooth_enableCycleCounter();
+
+	uint32_t randomState = config->seed != 0 ? config->seed : 1;
+	uint16_t receivedPackets = 0;
+	uint64_t totalMicroseconds = 0;
+
+	for(uint16_t packet = 0; packet < config->packetCount; ++packet)
+	{
+		fillPattern(txPattern, config->packetSize, &randomState);
+
+		const uint32_t cycleStart = DWT->CYCCNT;
+
+		++result->packetsSent;
+
+		if(bluetooth_exchangeData(bluetooth, txPattern, rxPattern, config->packetSize, config->timeout) != BLUETOOTH_OK)
+		{
+			++result->packetsLost;
+			drainLink(bluetooth);
+			continue;
+		}
+
+		const uint32_t latency = bluetooth_cyclesToMicroseconds(DWT->CYCCNT - cycleStart);
+		latenciesUs[receivedPackets++] = latency;
+		totalMicroseconds += latency;
+
+		for(uint16_t i = 0; i < config->packetSize; ++i)
+		{
+			const uint8_t difference = txPattern[i] ^ rxPattern[i];
+			if(difference)
+			{
+				++result->byteErrors;
+				result->bitErrors += countBits(difference);
+			}
+		}
+		result->bytesCompared += config->packetSize;
+	}
+
+	if(receivedPackets == 0)
+	{
+		return BLUETOOTH_FAIL;
+	}
+
+	sortLatencies(latenciesUs, receivedPackets);
+	result->latencyP50Us = percentile(latenciesUs, receivedPackets, 50);
+	result->latencyP90Us = percentile(latenciesUs, receivedPackets, 90);
+	result->latencyP99Us = percentile(latenciesUs, receivedPackets, 99);
+	result->latencyMaxUs = latenciesUs[receivedPackets - 1];
+
+	if(totalMicroseconds > 0)
+	{
+		result->stopAndWaitBytesPerSecond = (uint32_t)((uint64_t)result->bytesCompared * 1000000U / totalMicroseconds);
+	}
+
+	// stop-and-wait needs blocking and IT receptions, so the RX stream only runs in this second phase
+	return runPipelinedPhase(bluetooth, config, result);
+}